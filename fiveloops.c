@@ -22,209 +22,3952 @@
     into submatrices, one per each of the "five loops".
     Their exact values are not very relevant, since they were calculated based on our personal CPU L1/2/3 cache sizes, 
     and our number of GPRs.
+
+    The loops can also be spread across several threads (see fiveloops_set_num_threads): the packed Bt panel
+    is shared by everyone, and each thread either takes whole MC blocks of the third loop with its own At, or,
+    when C is too short to give every thread an MC block, the threads share At and split the NR columns of
+    the second loop instead. Small C's with a long k get split between groups of threads first, along the
+    NC blocks and the KC panels, with every group taking its share of the panels the usual way.
+
+    The packing buffers At and Bt are owned by a fiveloops_ctx, so that they are allocated once and reused
+    across calls instead of being _mm_malloc'ed on every call (and, for At, on every KC block).
+
+    Since the same binary has to run on CPUs with quite different caches, MC, KC and NC are no longer fixed at
+    compile time: they are worked out once at startup from the host's cache sizes (sysfs, or cpuid if that
+    isn't available), together with the best microkernel the host supports, which fixes MR and NR.
+    The MC/KC/NC build flags are only used as a fallback when the cache sizes can't be found.
+
+    Built with -DFIVELOOPS_STATS, the loops also count the cycles spent in each of them, the bytes packed
+    and the kernel calls (see fiveloops_stats in fiveloops.h). Without it the counting compiles to nothing.
+
+    Matrices too big for memory can be streamed from disk instead (fiveloops_streamed), with a helper thread
+    reading in and packing the next panel of B while the current one computes.
+
+    Calls can also be queued instead of made (fiveloops_submit), to run on worker threads of their own while
+    the caller gets on with something else, with futures to wait on and dependencies between them.
+
+    The biggest multiplications can also be handed to an accelerator, if one has been registered
+    (fiveloops_set_offload): the host packs B for it, one panel ahead of the device.
+
+    Very big multiplications can optionally go through one or two levels of Strassen first, with the
+    five loops as the base case (see fiveloops_set_strassen and the end of the file).
+
+    A bias and an activation can be fused into the multiplication (fiveloops_scaled_epilogue), applied as the
+    kernels' tiles are stored on the last KC panel rather than in another pass over C.
+
+    When C is only written (betaC == 0, in one KC panel) and is bigger than the last level cache, the tiles
+    go out with streaming stores, so that C isn't read in from memory first just to be overwritten.
+
+    Everything above is for doubles. SGEMM, the mixed precision DSGEMM and ZGEMM are at the end of the file:
+    they run the same loop nest, instantiated per element type from fiveloops_gemm.inc.
+*/
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE   // for sched_setaffinity and the CPU_* macros
+#endif
+
+#include <immintrin.h>
+#include <limits.h>
+#include <omp.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <cpuid.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "fiveloops.h"
+
+// The driver code from the class provided the element access macros (see fiveloops below) and the
+// block sizes as -D flags. They're repeated here, only where not already defined,
+// so that the file can also be built on its own, eg together with fiveloops_bench.c
+#ifndef alpha
+#define alpha( i,j ) A[ (i)*rsA + (j)*csA ]
+#define beta( i,j )  B[ (i)*rsB + (j)*csB ]
+#define gamma( i,j ) C[ (i)*rsC + (j)*csC ]
+#endif
+#ifndef min
+#define min( x, y ) ( ( x ) < ( y ) ? ( x ) : ( y ) )
+#endif
+#ifndef MC
+#define MC 96
+#endif
+#ifndef KC
+#define KC 256
+#endif
+#ifndef NC
+#define NC 4080
+#endif
+
+// The instrumentation hooks. Each thread counts into its own slot of the context's tstats,
+// and the slots are added up once the call is done (see stats_publish)
+#ifdef FIVELOOPS_STATS
+#define STATS_START( t )             unsigned long long t = __rdtsc()
+#define STATS_ADD( ctx, field, v )   ( (ctx)->tstats[ omp_get_thread_num() ].s.field += (v) )
+#define STATS_STOP( ctx, field, t )  STATS_ADD( ctx, field, __rdtsc() - (t) )
+#else
+#define STATS_START( t )
+#define STATS_ADD( ctx, field, v )
+#define STATS_STOP( ctx, field, t )
+#endif
+
+// Number of threads the five loops are spread across; 1 keeps everything on the calling thread
+static int fiveloops_num_threads = 1;
+
+// A thread count of 0 (or less) means "whatever OpenMP would use by default", ie OMP_NUM_THREADS or one per core
+void fiveloops_set_num_threads( int nthreads )
+
+{
+  fiveloops_num_threads = nthreads > 0 ? nthreads : omp_get_max_threads();
+}
+
+// Strassen is off unless asked for, since it gives up some accuracy (see fiveloops_strassen)
+#define STRASSEN_MAX_LEVELS 2
+#define STRASSEN_MIN_DIM    4096
+
+static int strassen_max_levels = 0;
+static int strassen_min_dim = STRASSEN_MIN_DIM;
+
+// Up to levels (at most STRASSEN_MAX_LEVELS, 0 to turn it off again) levels of Strassen, each one only taken
+// while the smallest of m, n and k is still at least min_dim (0 or less for the default)
+void fiveloops_set_strassen( int levels, int min_dim )
+
+{
+  strassen_max_levels = levels < 0 ? 0 : min(levels, STRASSEN_MAX_LEVELS);
+  strassen_min_dim = min_dim > 0 ? min_dim : STRASSEN_MIN_DIM;
+}
+
+// In reproducible mode every call rounds the same way, whatever the host, the kernel, the thread count or the run.
+// The kernels all add up their tile one k at a time in order, starting from zero, and only then add on
+// betaC C (see add_scaled), whatever their tile shape or ISA. And every tile of C only ever gets
+// updated by one thread at a time, once per KC panel, in order. So the one thing the total depends on is
+// where the KC panels start, and the only things that change that from run to run are KC itself (which
+// comes from the host's L1) and the k split between groups of threads (which comes from the thread count).
+// Reproducible contexts have KC fixed at REPRO_KC, with MC and NC scaled to keep the same footprints, and
+// never split k. They don't hand anything to an accelerator either, since there's no telling how that adds up
+#ifndef REPRO_KC
+#define REPRO_KC 128
+#endif
+
+static int fiveloops_reproducible = 0;
+
+// Only affects the contexts created from now on (and the default ones, which get recreated)
+void fiveloops_set_reproducible( int on )
+
+{
+  fiveloops_reproducible = on != 0;
+}
+
+// No accelerator unless one is registered, and then only for multiplications of at least this many flops:
+// below that, getting A, B and C across costs more than the device saves (see offload_gemm)
+#define OFFLOAD_MIN_FLOPS 1e10
+
+static const fiveloops_offload *offload = NULL;
+static double offload_min_flops = OFFLOAD_MIN_FLOPS;
+
+// backend NULL goes back to doing everything on the host. min_flops 0 (or less) for the default
+void fiveloops_set_offload( const fiveloops_offload *backend, double min_flops )
+
+{
+  offload = backend;
+  offload_min_flops = min_flops > 0 ? min_flops : OFFLOAD_MIN_FLOPS;
+}
+
+enum isa { ISA_AVX2, ISA_AVX512 };
+
+// The kernels the dispatcher can pick from, best first; the first one the host supports wins
+// (unless FIVELOOPS_KERNEL names a different one). The packing routines work for any mr and nr,
+// so a kernel only needs an entry here
+static const struct ukernel_info {
+  const char *name;
+  enum isa isa;
+  int mr, nr;
+  dgemm_ukernel_t ukernel;
+  dgemm_ukernel_t ukernel_nt;   // its streaming variant for betaC == 0 (see stream_C), if it has one
+} ukernels[] = {
+  { "avx512_24x8_pf",  ISA_AVX512, 24, 8, dgemm_ukernel_packed_24x8_pf, dgemm_ukernel_packed_24x8_nt },
+  { "avx512_24x8",     ISA_AVX512, 24, 8, dgemm_ukernel_packed_24x8, NULL },
+  { "avx512_16x8_gen", ISA_AVX512, 16, 8, dgemm_ukernel_gen_avx512_16x8, NULL },
+  { "avx2_8x6_pf",     ISA_AVX2,    8, 6, dgemm_ukernel_packed_8x6_pf, dgemm_ukernel_packed_8x6_nt },
+  { "avx2_8x6",        ISA_AVX2,    8, 6, dgemm_ukernel_packed_8x6, NULL },
+  { "avx2_8x6_gen",    ISA_AVX2,    8, 6, dgemm_ukernel_gen_avx2_8x6, NULL },
+  { "avx2_12x4_gen",   ISA_AVX2,   12, 4, dgemm_ukernel_gen_avx2_12x4, NULL },
+  { "avx2_8x4_gen",    ISA_AVX2,    8, 4, dgemm_ukernel_gen_avx2_8x4, NULL },
+  { "avx2_4x4_pf",     ISA_AVX2,    4, 4, dgemm_ukernel_packed_pf, NULL },
+  { "avx2_4x4",        ISA_AVX2,    4, 4, dgemm_ukernel_packed, NULL },
+  { "avx2_4x4_gen",    ISA_AVX2,    4, 4, dgemm_ukernel_gen_avx2_4x4, NULL },
+};
+
+// The same for SGEMM, whose kernels work on floats (see fiveloops_gemm.inc). The mixed precision and
+// complex multiplications run on the double kernels above
+static const struct sukernel_info {
+  const char *name;
+  enum isa isa;
+  int mr, nr;
+  sgemm_ukernel_t ukernel;
+} sukernels[] = {
+  { "avx512_48x8_s",   ISA_AVX512, 48, 8, sgemm_ukernel_avx512_48x8 },
+  { "avx2_16x6_s",     ISA_AVX2,   16, 6, sgemm_ukernel_avx2_16x6 },
+};
+
+// No kernel above has a tile of C bigger than this (see ukernel_fringe)
+#define MAX_TILE 512
+
+static int isa_supported( enum isa isa )
+
+{
+  __builtin_cpu_init();
+  switch (isa) {
+    case ISA_AVX2:   return __builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma");
+    case ISA_AVX512: return __builtin_cpu_supports("avx512f");
+  }
+  return 0;
+}
+
+struct cache_info {
+  size_t size;
+  int ways, line;
+};
+
+// Reads a number like "48K" or "12" out of a sysfs file, -1 if there's no such file
+static long read_sysfs( const char *dir, const char *file )
+
+{
+  char path[256], buf[64];
+  snprintf(path, sizeof(path), "%s/%s", dir, file);
+  FILE *f = fopen(path, "r");
+  if (!f)
+    return -1;
+  long v = -1;
+  if (fgets(buf, sizeof(buf), f)) {
+    char *end;
+    v = strtol(buf, &end, 10);
+    if (*end == 'K') v <<= 10;
+    if (*end == 'M') v <<= 20;
+  }
+  fclose(f);
+  return v;
+}
+
+// Linux lists every cache that cpu0 sees under /sys/devices/system/cpu/cpu0/cache/indexN
+static int cache_from_sysfs( int level, struct cache_info *c )
+
+{
+  for (int idx=0; idx<16; idx++) {
+    char dir[128], type[32] = "";
+    snprintf(dir, sizeof(dir), "/sys/devices/system/cpu/cpu0/cache/index%d", idx);
+
+    if (read_sysfs(dir, "level") != level)
+      continue;
+    char path[160];
+    snprintf(path, sizeof(path), "%s/type", dir);
+    FILE *f = fopen(path, "r");
+    if (!f || !fgets(type, sizeof(type), f)) {
+      if (f) fclose(f);
+      continue;
+    }
+    fclose(f);
+    if (strncmp(type, "Data", 4) && strncmp(type, "Unified", 7))
+      continue;
+
+    c->size = read_sysfs(dir, "size");
+    c->ways = read_sysfs(dir, "ways_of_associativity");
+    c->line = read_sysfs(dir, "coherency_line_size");
+    return c->size > 0 && c->ways > 0 && c->line > 0;
+  }
+  return 0;
+}
+
+// Intel's deterministic cache parameters leaf (4) and AMD's (0x8000001D) have the same layout
+static int cache_from_cpuid( int level, struct cache_info *c )
+
+{
+  unsigned a, b, cx, d, leaf = 4;
+  if (!__get_cpuid(0, &a, &b, &cx, &d))
+    return 0;
+  if (b == 0x68747541) { // "Auth"enticAMD
+    if (__get_cpuid_max(0x80000000, NULL) < 0x8000001D)
+      return 0;
+    leaf = 0x8000001D;
+  }
+
+  for (unsigned sub=0; sub<16; sub++) {
+    __cpuid_count(leaf, sub, a, b, cx, d);
+    int type = a & 0x1f;
+    if (type == 0)
+      break;
+    if ((int) ((a >> 5) & 0x7) != level || type == 2) // 2 is an instruction cache
+      continue;
+    c->ways = ((b >> 22) & 0x3ff) + 1;
+    c->line = (b & 0xfff) + 1;
+    c->size = (size_t) c->ways * (((b >> 12) & 0x3ff) + 1) * c->line * (cx + 1);
+    return 1;
+  }
+  return 0;
+}
+
+static int cache_level( int level, struct cache_info *c )
+
+{
+  return cache_from_sysfs(level, c) || cache_from_cpuid(level, c);
+}
+
+// Picks MC, KC and NC for an MR x NR kernel on elements of the given size along the lines of Low et al., "Analytical Modeling Is Enough for
+// High-Performance BLIS" (2016):
+//  - KC: the kc x nr sliver of Bt stays in L1 while the mr x kc slivers of At stream through it, so the At
+//        sliver gets the L1 ways in proportion mr : (mr + nr), keeping one way free for C
+//  - MC: the MC x KC block of At takes about half of L2, leaving the rest for the Bt slivers and C
+//  - NC: the KC x NC panel of Bt takes about half of L3 (which is shared, like Bt)
+static void derive_sizes( int mr, int nr, size_t elem, int *mc, int *kc, int *nc )
+
+{
+  *mc = MC;
+  *kc = KC;
+  *nc = NC;
+
+  struct cache_info l1, l2, l3;
+  if (cache_level(1, &l1)) {
+    int sets = l1.size / ((size_t) l1.ways * l1.line);
+    int ways_A = (l1.ways - 1) * mr / (mr + nr);
+    if (ways_A > 0)
+      *kc = ways_A * sets * l1.line / (mr * (int) elem);
+  }
+  if (cache_level(2, &l2))
+    *mc = l2.size / 2 / ((size_t) *kc * elem);
+  if (cache_level(3, &l3))
+    *nc = l3.size / 2 / ((size_t) *kc * elem);
+
+  // Keep MC and NC whole numbers of slivers, and NC within reason on hosts with huge L3s
+  // (the Bt buffer is KC*NC elements either way)
+  *kc = *kc < 16 ? 16 : *kc;
+  *mc = *mc < mr ? mr : *mc / mr * mr;
+  *nc = *nc > 4096 ? 4096 : *nc;
+  *nc = *nc < nr ? nr : *nc / nr * nr;
+}
+
+static void derive_blocking( const struct ukernel_info *u, fiveloops_blocking *b )
+
+{
+  b->mr = u->mr;
+  b->nr = u->nr;
+  b->ukernel = u->ukernel;
+  b->ukernel_nt = u->ukernel_nt;
+  b->kernel = u->name;
+  derive_sizes(u->mr, u->nr, sizeof(double), &b->mc, &b->kc, &b->nc);
+}
+
+static fiveloops_blocking host_blocking;
+static pthread_once_t host_blocking_once = PTHREAD_ONCE_INIT;
+
+// How big C has to be before it gets streamed out past the caches: the size of the last level cache,
+// once host_blocking_init has found it. Any smaller and C is better off staying in cache for whoever reads it next
+#ifndef STREAM_MIN_BYTES
+#define STREAM_MIN_BYTES ((size_t) 32 << 20)
+#endif
+
+static size_t stream_min_bytes = STREAM_MIN_BYTES;
+
+static void host_blocking_init( void )
+
+{
+  size_t nkernels = sizeof(ukernels) / sizeof(ukernels[0]);
+  size_t i = 0;
+  while (i + 1 < nkernels && !isa_supported(ukernels[i].isa))
+    i++;
+
+  // FIVELOOPS_KERNEL=avx2_4x4 (say) overrides the choice, as long as the host can actually run it
+  const char *want = getenv("FIVELOOPS_KERNEL");
+  for (size_t w=0; want && w<nkernels; w++)
+    if (!strcmp(want, ukernels[w].name) && isa_supported(ukernels[w].isa))
+      i = w;
+
+  derive_blocking(&ukernels[i], &host_blocking);
+
+  // FIVELOOPS_STREAM=0 never streams C out (see stream_C)
+  struct cache_info llc;
+  const char *stream = getenv("FIVELOOPS_STREAM");
+  if (stream && !strcmp(stream, "0"))
+    stream_min_bytes = (size_t) -1;
+  else if (cache_level(3, &llc) || cache_level(2, &llc))
+    stream_min_bytes = llc.size;
+}
+
+// The blocking (and kernel) chosen for this host; worked out on first use
+const fiveloops_blocking *fiveloops_host_blocking( void )
+
+{
+  pthread_once(&host_blocking_once, host_blocking_init);
+  return &host_blocking;
+}
+
+static fiveloops_sblocking host_sblocking;
+static pthread_once_t host_sblocking_once = PTHREAD_ONCE_INIT;
+
+static void host_sblocking_init( void )
+
+{
+  size_t nkernels = sizeof(sukernels) / sizeof(sukernels[0]);
+  size_t i = 0;
+  while (i + 1 < nkernels && !isa_supported(sukernels[i].isa))
+    i++;
+
+  const char *want = getenv("FIVELOOPS_KERNEL");
+  for (size_t w=0; want && w<nkernels; w++)
+    if (!strcmp(want, sukernels[w].name) && isa_supported(sukernels[w].isa))
+      i = w;
+
+  const struct sukernel_info *u = &sukernels[i];
+  host_sblocking.mr = u->mr;
+  host_sblocking.nr = u->nr;
+  host_sblocking.ukernel = u->ukernel;
+  host_sblocking.kernel = u->name;
+  derive_sizes(u->mr, u->nr, sizeof(float), &host_sblocking.mc, &host_sblocking.kc, &host_sblocking.nc);
+}
+
+const fiveloops_sblocking *fiveloops_host_sblocking( void )
+
+{
+  pthread_once(&host_sblocking_once, host_sblocking_init);
+  return &host_sblocking;
+}
+
+int fiveloops_kernels( const char **names, int max )
+
+{
+  int count = 0;
+  for (size_t i=0; i<sizeof(ukernels) / sizeof(ukernels[0]); i++)
+    if (isa_supported(ukernels[i].isa)) {
+      if (count < max)
+        names[count] = ukernels[i].name;
+      count++;
+    }
+  return count;
+}
+
+// The host's NUMA nodes, as far as sysfs knows them: the CPUs of each one that has any.
+// On a single-node host (or with FIVELOOPS_NUMA=0) that's just the one, and none of the NUMA handling kicks in
+#define MAX_NODES 8
+#define MAX_GROUPS 64
+
+static struct {
+  int count;
+  int id[MAX_NODES];
+  cpu_set_t cpus[MAX_NODES];
+} numa;
+static pthread_once_t numa_once = PTHREAD_ONCE_INIT;
+
+// Reads a cpulist like "0-3,8-11", 0 if there's no such file or no CPU in it
+static int read_cpulist( const char *path, cpu_set_t *set )
+
+{
+  FILE *f = fopen(path, "r");
+  if (!f)
+    return 0;
+
+  CPU_ZERO(set);
+  int lo, hi;
+  while (fscanf(f, "%d", &lo) == 1) {
+    hi = lo;
+    int c = fgetc(f);
+    if (c == '-') {
+      if (fscanf(f, "%d", &hi) != 1)
+        break;
+      c = fgetc(f);
+    }
+    for (int cpu=lo; cpu<=hi && cpu<CPU_SETSIZE; cpu++)
+      CPU_SET(cpu, set);
+    if (c != ',')
+      break;
+  }
+  fclose(f);
+  return CPU_COUNT(set) > 0;
+}
+
+static void numa_init( void )
+
+{
+  const char *env = getenv("FIVELOOPS_NUMA");
+  for (int node=0; node<64 && numa.count<MAX_NODES; node++) {
+    char path[64];
+    snprintf(path, sizeof(path), "/sys/devices/system/node/node%d/cpulist", node);
+    if (read_cpulist(path, &numa.cpus[numa.count]))
+      numa.id[numa.count++] = node;
+  }
+  if (env && !strcmp(env, "0") && numa.count > 1)
+    numa.count = 1;
+}
+
+// The node this thread is pinned to, -1 for none
+static __thread int pinned_node = -1;
+
+// Keeps the calling thread on the CPUs of the given node (one of numa's, not the sysfs number).
+// libgomp reuses its threads, so this only has to make the system call the first time round
+static void pin_to_node( int node )
+
+{
+  if (pinned_node != node) {
+    sched_setaffinity(0, sizeof(cpu_set_t), &numa.cpus[node]);
+    pinned_node = node;
+  }
+}
+
+// The node and group contexts run their own parallel regions inside the one over the nodes (groups), which
+// needs at least two active levels. That's the application's setting, though, so it only gets raised for the
+// duration: nest_begin returns what it was for nest_end to put back
+static int nest_begin( void )
+
+{
+  int levels = omp_get_max_active_levels();
+  if (levels < 2)
+    omp_set_max_active_levels(2);
+  return levels;
+}
+
+static void nest_end( int levels )
+
+{
+  if (levels < 2)
+    omp_set_max_active_levels(levels);
+}
+
+// What each thread tells the others about the MC block it's working on, for threeloops_steal.
+// Every field but i and ib is only ever touched atomically
+struct steal_slot {
+  int i, ib;     // the block the owner has packed into its At: rows i .. i+ib-1
+  int next;      // the next chunk of NR panels up for grabs; way past the last one while the slot is closed
+  int busy;      // how many other threads are in the slot (and may be reading the At)
+  int packing;   // the owner is about to open the slot with a new block
+} __attribute__((aligned(64)));
+
+// A context owns the packing buffers: one KC x NC Bt panel that all threads share,
+// and one MC x KC At block per thread. A context must not be used by two calls at the same time
+struct fiveloops_ctx {
+  int nthreads;
+  fiveloops_blocking blk;
+  fiveloops_sblocking sblk;   // for SGEMM, which packs floats into the same buffers
+
+  double *Bt;
+  size_t Bt_bytes;
+
+  double *At;         // thread t packs into At + t*At_stride
+  size_t At_stride;   // in doubles, rounded up to a whole page so that no two threads share one
+  size_t At_bytes;
+
+  // Batched calls give every thread a Bt of its own as well (see dgemm_batch). These are only as big
+  // as the biggest batch entry so far, and only get mapped when a batch needs them
+  double *Bt_thread;
+  size_t Bt_thread_stride;
+  size_t Bt_thread_bytes;
+
+  // Streaming calls pack the next Bt panel into a second one while the first is in use (see fiveloops_streamed).
+  // Only mapped once a streaming call needs it
+  double *Bt_next;
+
+#ifdef FIVELOOPS_STATS
+  // one cache line (at least) per thread, so the counters don't bounce between cores
+  struct stats_slot { fiveloops_stats s; } __attribute__((aligned(64))) *tstats;
+#endif
+
+  // With more than one NUMA node, a context also has a child context for each node, with that node's share
+  // of the threads and buffers of its own. The children's threads stay on their node, so the first touch
+  // puts the buffers in the node's memory, and the big multiplications split their NC blocks between
+  // the nodes (see fiveloops_from). node is the child's node, -1 for everything else
+  int node;
+  int nnodes;
+  struct fiveloops_ctx *nodes[MAX_NODES];
+
+  int reproducible;   // see fiveloops_set_reproducible
+
+  const struct ep_call *ep;   // the epilogue of the call in progress, if it has one (see fiveloops_scaled_epilogue)
+
+  // The work-stealing third loop's state (see threeloops_steal), if this context uses it
+  int use_steal;
+  struct steal_slot *steal;
+  int steal_next_i;
+
+  // Multiplications too small in m and n to keep all the threads busy get split between groups of threads
+  // instead, each group a child context with its share of the threads (see fiveloops_split). The groups are
+  // made the first time a split needs them, and kept for as long as the splits need that many. Cw holds
+  // the partial C's of the k split. kinfo is the kernel the context was made for, if it wasn't the host's
+  const struct ukernel_info *kinfo;
+  int use_split;
+  int ngroups;
+  struct fiveloops_ctx *groups[MAX_GROUPS];
+  double *Cw;
+  size_t Cw_bytes;
+};
+
+static fiveloops_stats stats_total;
+static fiveloops_stats_callback stats_callback;
+static void *stats_callback_user;
+static pthread_mutex_t stats_lock = PTHREAD_MUTEX_INITIALIZER;
+
+void fiveloops_stats_get( fiveloops_stats *total )
+
+{
+  pthread_mutex_lock(&stats_lock);
+  *total = stats_total;
+  pthread_mutex_unlock(&stats_lock);
+}
+
+void fiveloops_stats_reset( void )
+
+{
+  pthread_mutex_lock(&stats_lock);
+  memset(&stats_total, 0, sizeof(stats_total));
+  pthread_mutex_unlock(&stats_lock);
+}
+
+void fiveloops_stats_set_callback( fiveloops_stats_callback cb, void *user )
+
+{
+  pthread_mutex_lock(&stats_lock);
+  stats_callback = cb;
+  stats_callback_user = user;
+  pthread_mutex_unlock(&stats_lock);
+}
+
+#ifdef FIVELOOPS_STATS
+static void stats_begin( fiveloops_ctx *ctx )
+
+{
+  memset(ctx->tstats, 0, sizeof(ctx->tstats[0]) * ctx->nthreads);
+  for (int nd=0; nd<ctx->nnodes; nd++)
+    stats_begin(ctx->nodes[nd]);
+  for (int g=0; g<ctx->ngroups; g++)
+    stats_begin(ctx->groups[g]);
+}
+
+static void stats_sum( const fiveloops_ctx *ctx, unsigned long long *sum )
+
+{
+  for (int t=0; t<ctx->nthreads; t++) {
+    unsigned long long *slot = (unsigned long long *) &ctx->tstats[t].s;
+    for (size_t f=0; f<sizeof(fiveloops_stats) / sizeof(unsigned long long); f++)
+      sum[f] += slot[f];
+  }
+  for (int nd=0; nd<ctx->nnodes; nd++)
+    stats_sum(ctx->nodes[nd], sum);
+  for (int g=0; g<ctx->ngroups; g++)
+    stats_sum(ctx->groups[g], sum);
+}
+
+// Adds up the threads' counters for the call that just finished, adds those to the totals
+// and passes them on to the callback, if there is one
+static void stats_publish( fiveloops_ctx *ctx )
+
+{
+  fiveloops_stats call = { 0 };
+  unsigned long long *sum = (unsigned long long *) &call;
+  stats_sum(ctx, sum);
+  call.calls = 1;
+
+  pthread_mutex_lock(&stats_lock);
+  unsigned long long *total = (unsigned long long *) &stats_total;
+  for (size_t f=0; f<sizeof(fiveloops_stats) / sizeof(unsigned long long); f++)
+    total[f] += sum[f];
+  fiveloops_stats_callback cb = stats_callback;
+  void *user = stats_callback_user;
+  pthread_mutex_unlock(&stats_lock);
+
+  if (cb)
+    cb(&call, user);
+}
+#else
+static void stats_begin( fiveloops_ctx *ctx ) { (void) ctx; }
+static void stats_publish( fiveloops_ctx *ctx ) { (void) ctx; }
+#endif
+
+// The buffers get their own mappings, aligned on and rounded up to 2MB, and we ask the kernel to back
+// them with transparent huge pages. A KC x NC Bt panel would otherwise take up hundreds of TLB entries
+#define ARENA_ALIGN ((size_t) 2 << 20)
+#define PAGE_BYTES  ((size_t) 4096)
+
+static size_t round_up( size_t x, size_t to ) { return (x + to - 1) / to * to; }
+
+static double *arena_alloc( size_t bytes )
+
+{
+  bytes = round_up(bytes, ARENA_ALIGN);
+
+  // mmap only promises 4K alignment, so map an extra 2MB and trim off whatever is left over on either side
+  char *raw = mmap(NULL, bytes + ARENA_ALIGN, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (raw == MAP_FAILED)
+    return NULL;
+
+  char *p = (char *) round_up((size_t) raw, ARENA_ALIGN);
+  if (p > raw)
+    munmap(raw, p - raw);
+  munmap(p + bytes, (raw + ARENA_ALIGN) - p);
+
+#ifdef MADV_HUGEPAGE
+  madvise(p, bytes, MADV_HUGEPAGE);
+#endif
+  return (double *) p;
+}
+
+static void arena_free( double *p, size_t bytes )
+
+{
+  if (p)
+    munmap(p, round_up(bytes, ARENA_ALIGN));
+}
+
+void fiveloops_ctx_free( fiveloops_ctx *ctx )
+
+{
+  if (!ctx)
+    return;
+  arena_free(ctx->Bt, ctx->Bt_bytes);
+  arena_free(ctx->At, ctx->At_bytes);
+  arena_free(ctx->Bt_thread, ctx->Bt_thread_bytes);
+  arena_free(ctx->Bt_next, ctx->Bt_bytes);
+#ifdef FIVELOOPS_STATS
+  free(ctx->tstats);
+#endif
+  free(ctx->steal);
+  for (int nd=0; nd<ctx->nnodes; nd++)
+    fiveloops_ctx_free(ctx->nodes[nd]);
+  for (int g=0; g<ctx->ngroups; g++)
+    fiveloops_ctx_free(ctx->groups[g]);
+  arena_free(ctx->Cw, ctx->Cw_bytes);
+  free(ctx);
+}
+
+// Makes sure every thread has a Bt of at least 'doubles' of its own. Returns 0 if that can't be mapped
+static int ctx_reserve_thread_Bt( fiveloops_ctx *ctx, size_t doubles )
+
+{
+  if (doubles <= ctx->Bt_thread_stride)
+    return 1;
+
+  arena_free(ctx->Bt_thread, ctx->Bt_thread_bytes);
+  ctx->Bt_thread_stride = round_up(doubles * sizeof(double), PAGE_BYTES) / sizeof(double);
+  ctx->Bt_thread_bytes = ctx->Bt_thread_stride * sizeof(double) * ctx->nthreads;
+  ctx->Bt_thread = arena_alloc(ctx->Bt_thread_bytes);
+  if (!ctx->Bt_thread) {
+    ctx->Bt_thread_stride = ctx->Bt_thread_bytes = 0;
+    return 0;
+  }
+  return 1;
+}
+
+// Sizes the buffers once from MC, KC and NC (for the given kernel, or the host's if u is NULL)
+static fiveloops_ctx *ctx_create( int nthreads, const struct ukernel_info *u, int node, int reproducible )
+
+{
+  fiveloops_ctx *ctx = calloc(1, sizeof(fiveloops_ctx));
+  if (!ctx)
+    return NULL;
+
+  ctx->nthreads = nthreads;
+  ctx->node = node;
+  ctx->kinfo = u;
+  if (u)
+    derive_blocking(u, &ctx->blk);
+  else
+    ctx->blk = *fiveloops_host_blocking();
+  ctx->sblk = *fiveloops_host_sblocking();
+  ctx->reproducible = reproducible;
+  if (reproducible) {
+    fiveloops_blocking *rb = &ctx->blk;
+    int mc = (int) ((long) rb->mc * rb->kc / REPRO_KC), nc = (int) ((long) rb->nc * rb->kc / REPRO_KC);
+    rb->mc = mc < rb->mr ? rb->mr : mc / rb->mr * rb->mr;
+    rb->nc = nc < rb->nr ? rb->nr : nc / rb->nr * rb->nr;
+    rb->kc = REPRO_KC;
+  }
+  const fiveloops_blocking *b = &ctx->blk;
+  const fiveloops_sblocking *sb = &ctx->sblk;
+
+  // big enough for whichever of the two blockings needs more
+  size_t Bt_bytes = (size_t) b->kc * b->nc * sizeof(double);
+  size_t At_bytes = (size_t) b->mc * b->kc * sizeof(double);
+  if ((size_t) sb->kc * sb->nc * sizeof(float) > Bt_bytes)
+    Bt_bytes = (size_t) sb->kc * sb->nc * sizeof(float);
+  if ((size_t) sb->mc * sb->kc * sizeof(float) > At_bytes)
+    At_bytes = (size_t) sb->mc * sb->kc * sizeof(float);
+
+  ctx->Bt_bytes = Bt_bytes;
+  ctx->At_stride = round_up(At_bytes, PAGE_BYTES) / sizeof(double);
+  ctx->At_bytes = ctx->At_stride * sizeof(double) * ctx->nthreads;
+
+  ctx->Bt = arena_alloc(ctx->Bt_bytes);
+  ctx->At = arena_alloc(ctx->At_bytes);
+#ifdef FIVELOOPS_STATS
+  ctx->tstats = aligned_alloc(64, sizeof(ctx->tstats[0]) * ctx->nthreads);
+  if (!ctx->tstats) {
+    fiveloops_ctx_free(ctx);
+    return NULL;
+  }
+#endif
+
+  // One thread has nobody to steal from. FIVELOOPS_STEAL=0 goes back to the static splits
+  const char *steal = getenv("FIVELOOPS_STEAL");
+  ctx->use_steal = ctx->nthreads > 1 && !(steal && !strcmp(steal, "0"));
+  if (ctx->use_steal) {
+    ctx->steal = aligned_alloc(64, sizeof(struct steal_slot) * ctx->nthreads);
+    if (!ctx->steal) {
+      fiveloops_ctx_free(ctx);
+      return NULL;
+    }
+    memset(ctx->steal, 0, sizeof(struct steal_slot) * ctx->nthreads);
+  }
+
+  // Same for the splits between groups of threads (FIVELOOPS_SPLIT=0 keeps every call on all the threads)
+  const char *split = getenv("FIVELOOPS_SPLIT");
+  ctx->use_split = ctx->nthreads > 1 && !(split && !strcmp(split, "0"));
+  if (!ctx->Bt || !ctx->At) {
+    fiveloops_ctx_free(ctx);
+    return NULL;
+  }
+  return ctx;
+}
+
+// Returns NULL if the buffers can't be mapped (or if the host can't run the kernel that was asked for)
+fiveloops_ctx *fiveloops_ctx_create_kernel( int nthreads, const char *kernel )
+
+{
+  const struct ukernel_info *u = NULL;
+  for (size_t i=0; kernel && i<sizeof(ukernels) / sizeof(ukernels[0]); i++)
+    if (!strcmp(kernel, ukernels[i].name) && isa_supported(ukernels[i].isa))
+      u = &ukernels[i];
+  if (kernel && !u)
+    return NULL;
+
+  nthreads = nthreads > 0 ? nthreads : omp_get_max_threads();
+  fiveloops_ctx *ctx = ctx_create(nthreads, u, -1, fiveloops_reproducible);
+  if (!ctx)
+    return NULL;
+
+  // Only worth it if every node gets a thread at least
+  pthread_once(&numa_once, numa_init);
+  if (numa.count > 1 && nthreads >= numa.count) {
+    for (int nd=0; nd<numa.count; nd++) {
+      int share = nthreads / numa.count + (nd < nthreads % numa.count);
+      ctx->nodes[nd] = ctx_create(share, u, nd, ctx->reproducible);
+      ctx->nnodes = nd + 1;
+      if (!ctx->nodes[nd]) {
+        fiveloops_ctx_free(ctx);
+        return NULL;
+      }
+    }
+  }
+  return ctx;
+}
+
+fiveloops_ctx *fiveloops_ctx_create( int nthreads )
+
+{
+  return fiveloops_ctx_create_kernel(nthreads, NULL);
+}
+
+const fiveloops_blocking *fiveloops_ctx_blocking( const fiveloops_ctx *ctx )
+
+{
+  return &ctx->blk;
+}
+
+// fiveloops() without a context uses one per calling thread, created on first use
+// (and recreated if fiveloops_set_num_threads or fiveloops_set_reproducible changed things since)
+static pthread_key_t default_ctx_key;
+static pthread_once_t default_ctx_once = PTHREAD_ONCE_INIT;
+
+static void default_ctx_key_create( void ) { pthread_key_create(&default_ctx_key, (void (*)(void *)) fiveloops_ctx_free); }
+
+static fiveloops_ctx *default_ctx( void )
+
+{
+  pthread_once(&default_ctx_once, default_ctx_key_create);
+
+  fiveloops_ctx *ctx = pthread_getspecific(default_ctx_key);
+  if (!ctx || ctx->nthreads != fiveloops_num_threads || ctx->reproducible != fiveloops_reproducible) {
+    fiveloops_ctx_free(ctx);
+    ctx = fiveloops_ctx_create(fiveloops_num_threads);
+    if (!ctx) {
+      fprintf(stderr, "fiveloops: could not allocate the packing buffers\n");
+      abort();
+    }
+    pthread_setspecific(default_ctx_key, ctx);
+  }
+  return ctx;
+}
+
+/*
+ * Matrix multiplication requires all three matrices to have certain dimensions.
+ * For the operation C = AB + C, where A B and C are all matrices:
+ * Let A be an m x n matrix, B must be an n x k matrix, C must be an m x k matrix
+ *
+    @param m              the column-length of matrices A and C
+    @param n              the row-length of matrix A, the column-length of matrix B
+    @param k              the row-length of matrices B and C
+
+    @params A, B, C       pointers to the matrices A, B and C
+    @params rsA, rsB, rsC the "row stride" of matrices A, B and C
+    @params csA, csB, csC the "column stride" of matrices A, B and C
+
+    Row stride is the number of bytes in memory between separate columns of a matrix
+    Column stride is the number of bytes in memory between separate rows of a matrix
+*/
+void fiveloops( int m, int n, int k, double *A, int rsA, int csA, 
+	     double *B, int rsB, int csB,  double *C, int rsC, int csC )
+
+{
+  fiveloops_ex( default_ctx(), m, n, k, A, rsA, csA, B, rsB, csB, C, rsC, csC );
+}
+
+static void fiveloops_from( fiveloops_ctx *ctx, int m, int n, int k, double alphaA, double *A, int rsA, int csA,
+       double *B, int rsB, int csB, const double *Bp, double betaC, double *C, int rsC, int csC );
+static void fourloops_from( fiveloops_ctx *ctx, int m, int n, int k, double alphaA, double *A, int rsA, int csA,
+       double *B, int rsB, int csB, const double *Bp, double betaC, double *C, int rsC, int csC );
+static int split_plan( const fiveloops_ctx *ctx, int m, int n, int k, int *gj, int *gk );
+static int fiveloops_split( fiveloops_ctx *ctx, int gj, int gk, int m, int n, int k, double alphaA,
+       double *A, int rsA, int csA, double *B, int rsB, int csB, double betaC, double *C, int rsC, int csC );
+static int strassen_levels( int m, int n, int k );
+static void fiveloops_strassen( fiveloops_ctx *ctx, int levels, int m, int n, int k, double alphaA,
+       double *A, int rsA, int csA, double *B, int rsB, int csB, double betaC, double *C, int rsC, int csC );
+
+// Same as fiveloops, but packs into (and threads according to) the given context
+void fiveloops_ex( fiveloops_ctx *ctx, int m, int n, int k, double *A, int rsA, int csA,
+       double *B, int rsB, int csB,  double *C, int rsC, int csC )
+
+{
+  fiveloops_scaled( ctx, m, n, k, 1.0, A, rsA, csA, B, rsB, csB, 1.0, C, rsC, csC );
+}
+
+// For tiny matrices the packing (and the blocking arithmetic, and starting up the threads) costs more than
+// the multiplication itself. Up to SMALL_MAX in every dimension, A, B and C are used as they are instead:
+// C is done 8 x 4 at a time straight from A's columns and B's elements, with the tile's width fixed at compile
+// time and the rows past the bottom of C masked off. That needs A and C column-major, or (by computing
+// C^T = B^T A^T instead) B and C row-major
+#ifndef SMALL_MAX
+#define SMALL_MAX 32
+#endif
+
+static inline __m256i rows_mask( int rows )
+
+{
+  return _mm256_setr_epi64x(rows > 0 ? -1 : 0, rows > 1 ? -1 : 0, rows > 2 ? -1 : 0, rows > 3 ? -1 : 0);
+}
+
+// C(0:m, 0:N) := alphaA A(0:m, 0:k) B(0:k, 0:N) + betaC C for m <= 4*R, with A and C column-major.
+// Always inlined with R and N constant, and R*N at most 8, which leaves registers for A and B.
+// The pragmas unroll the loops over R and N all the way, so that the accumulators stay in registers
+// and everything for the rows and columns that aren't there drops out
+static inline __attribute__((always_inline)) void small_tile( int R, int N, int m, int k, double alphaA,
+       const double *A, int csA, const double *B, int rsB, int csB, double betaC, double *C, int csC )
+
+{
+  __m256i mask[4];
+  __m256d c[4][8], a[4];
+
+  #pragma GCC unroll 4
+  for (int r=0; r<R; r++) {
+    mask[r] = rows_mask(m - 4*r);
+    #pragma GCC unroll 8
+    for (int j=0; j<N; j++)
+      c[r][j] = _mm256_setzero_pd();
+  }
+
+  for (int p=0; p<k; p++) {
+    const double *ap = &A[ (long) p*csA ];
+    #pragma GCC unroll 4
+    for (int r=0; r<R; r++)
+      a[r] = m == 4*R ? _mm256_loadu_pd(&ap[4*r]) : _mm256_maskload_pd(&ap[4*r], mask[r]);
+    #pragma GCC unroll 8
+    for (int j=0; j<N; j++) {
+      __m256d b = _mm256_broadcast_sd(&B[ (long) p*rsB + j*(long) csB ]);
+      #pragma GCC unroll 4
+      for (int r=0; r<R; r++)
+        c[r][j] = _mm256_fmadd_pd(a[r], b, c[r][j]);
+    }
+  }
+
+  __m256d va = _mm256_set1_pd(alphaA), vb = _mm256_set1_pd(betaC);
+  #pragma GCC unroll 8
+  for (int j=0; j<N; j++)
+    #pragma GCC unroll 4
+    for (int r=0; r<R; r++) {
+      double *cj = &C[ j*(long) csC + 4*r ];
+      __m256d v = _mm256_mul_pd(va, c[r][j]);
+      if (m == 4*R) {
+        if (betaC != 0.0)
+          v = _mm256_fmadd_pd(vb, _mm256_loadu_pd(cj), v);
+        _mm256_storeu_pd(cj, v);
+      } else {
+        if (betaC != 0.0)
+          v = _mm256_fmadd_pd(vb, _mm256_maskload_pd(cj, mask[r]), v);
+        _mm256_maskstore_pd(cj, mask[r], v);
+      }
+    }
+}
+
+#define SMALL_TILE( H, N )  small_tile( H, N, ib, k, alphaA, &A[i], csA, &B[ (long) j*csB ], rsB, csB, \
+                                        betaC, &C[ i + (long) j*csC ], csC )
+
+// The same tiles also do rank-k updates (k <= SKINNY_K, any m and n), where C is so much bigger than A and B
+// that all that matters is reading and writing C only once, which the tiles do since they hold all of k.
+// They go through C in blocks of SMALL_K_ROWS / k rows, so that the rows of A they need (SMALL_K_ROWS doubles,
+// 256 KB) stay in the L2. Not the L1: blocks short enough for that would read the columns of C in too many
+// short stretches. The blocks are shared out between the threads if there is enough work.
+// For bigger k the kernels win again, at least on AVX-512 hosts
+#ifndef SKINNY_K
+#define SKINNY_K 8
+#endif
+#define SMALL_K_ROWS 32768
+#define SKINNY_PARALLEL_FLOPS 1e6
+
+// Rows i0 .. i1-1 of C, with A and C column-major
+static void small_rows( int i0, int i1, int n, int k, double alphaA, const double *A, int csA,
+       const double *B, int rsB, int csB, double betaC, double *C, int csC )
+
+{
+  for (int j=0; j<n; j+=4)
+    for (int i=i0; i<i1; i+=8) {
+      int ib = min(8, i1-i);
+      switch (min(4, n-j) + 4 * (ib > 4)) {
+        case 1: SMALL_TILE( 1, 1 ); break;
+        case 2: SMALL_TILE( 1, 2 ); break;
+        case 3: SMALL_TILE( 1, 3 ); break;
+        case 4: SMALL_TILE( 1, 4 ); break;
+        case 5: SMALL_TILE( 2, 1 ); break;
+        case 6: SMALL_TILE( 2, 2 ); break;
+        case 7: SMALL_TILE( 2, 3 ); break;
+        case 8: SMALL_TILE( 2, 4 ); break;
+      }
+    }
+}
+
+// C := alphaA AB + betaC C for m, n, k <= SMALL_MAX or k <= SKINNY_K, without packing. Returns 0 without doing
+// anything if the matrices aren't laid out in a way it can handle
+static int gemm_small( int nthreads, int m, int n, int k, double alphaA, const double *A, int rsA, int csA,
+       const double *B, int rsB, int csB, double betaC, double *C, int rsC, int csC )
+
+{
+  if (rsA != 1 || rsC != 1) {
+    if (csB != 1 || csC != 1)
+      return 0;
+    return gemm_small( nthreads, n, m, k, alphaA, B, csB, rsB, A, csA, rsA, betaC, C, csC, rsC );
+  }
+
+  int mb = SMALL_K_ROWS / k / 8 * 8;
+  if (mb < 8)
+    mb = 8;
+
+  if (nthreads == 1 || 2.0 * m * n * k <= SKINNY_PARALLEL_FLOPS) {
+    for (int i=0; i<m; i+=mb)
+      small_rows( i, min(i + mb, m), n, k, alphaA, A, csA, B, rsB, csB, betaC, C, csC );
+    return 1;
+  }
+
+  #pragma omp parallel for num_threads(nthreads) schedule(static)
+  for (int i=0; i<m; i+=mb)
+    small_rows( i, min(i + mb, m), n, k, alphaA, A, csA, B, rsB, csB, betaC, C, csC );
+  return 1;
+}
+
+static int is_small( int m, int n, int k ) { return m <= SMALL_MAX && n <= SMALL_MAX && k <= SMALL_MAX; }
+
+// With only a few columns (n <= SKINNY_N, eg a handful of right hand sides) C and B are tiny and it's all
+// about streaming A from memory once, as fast as it'll go. Packing A would read it and then write it all
+// out again, and the kernels would waste most of their NR columns. So this does it the GEMV way instead:
+// A straight from memory, with all of C's columns in registers. When A is column-major that's small_tile
+// over GEMV_KB of A's columns at a time (only that many streams of A at once, or the prefetchers lose track),
+// and when it is row-major it's dot products of A's rows with B's columns. The fewer columns, the more rows
+// go at once, to keep enough FMAs in flight. The threads split the rows between them, GEMV_MB at a time
+#ifndef SKINNY_N
+#define SKINNY_N 8
+#endif
+#define GEMV_KB 16
+#define GEMV_MB 4096
+#define GEMV_DOT_KB 512
+
+static inline double hsum( __m256d v )
+
+{
+  __m128d s = _mm_add_pd(_mm256_castpd256_pd128(v), _mm256_extractf128_pd(v, 1));
+  return _mm_cvtsd_f64(_mm_add_sd(s, _mm_unpackhi_pd(s, s)));
+}
+
+// C(0:R, 0:N) := alphaA A(0:R, 0:k) B(0:k, 0:N) + betaC C for R*N <= 8, with A's rows and B's columns
+// contiguous: R*N dot products at once. Unrolled like small_tile
+static inline __attribute__((always_inline)) void gemv_dot( int R, int N, int k, double alphaA,
+       const double *A, int rsA, const double *B, int csB, double betaC, double *C, int rsC, int csC )
+
+{
+  __m256d c[4][8], a[4];
+
+  #pragma GCC unroll 4
+  for (int r=0; r<R; r++)
+    #pragma GCC unroll 8
+    for (int j=0; j<N; j++)
+      c[r][j] = _mm256_setzero_pd();
+
+  int p = 0;
+  for (; p+4<=k; p+=4) {
+    #pragma GCC unroll 4
+    for (int r=0; r<R; r++)
+      a[r] = _mm256_loadu_pd(&A[ (long) r*rsA + p ]);
+    #pragma GCC unroll 8
+    for (int j=0; j<N; j++) {
+      __m256d b = _mm256_loadu_pd(&B[ p + j*(long) csB ]);
+      #pragma GCC unroll 4
+      for (int r=0; r<R; r++)
+        c[r][j] = _mm256_fmadd_pd(a[r], b, c[r][j]);
+    }
+  }
+  if (p < k) {
+    __m256i mask = rows_mask(k-p);
+    #pragma GCC unroll 4
+    for (int r=0; r<R; r++)
+      a[r] = _mm256_maskload_pd(&A[ (long) r*rsA + p ], mask);
+    #pragma GCC unroll 8
+    for (int j=0; j<N; j++) {
+      __m256d b = _mm256_maskload_pd(&B[ p + j*(long) csB ], mask);
+      #pragma GCC unroll 4
+      for (int r=0; r<R; r++)
+        c[r][j] = _mm256_fmadd_pd(a[r], b, c[r][j]);
+    }
+  }
+
+  #pragma GCC unroll 4
+  for (int r=0; r<R; r++)
+    #pragma GCC unroll 8
+    for (int j=0; j<N; j++) {
+      double *cij = &C[ (long) r*rsC + j*(long) csC ];
+      *cij = alphaA * hsum(c[r][j]) + (betaC != 0.0 ? betaC * *cij : 0.0);
+    }
+}
+
+// The rows i0 .. i1-1 of C, N columns (N constant again)
+static inline __attribute__((always_inline)) void gemv_rows( int N, int i0, int i1, int k, double alphaA,
+       const double *A, int rsA, int csA, const double *B, int rsB, int csB, double betaC, double *C, int rsC, int csC )
+
+{
+  const int R = N <= 2 ? 4 : N <= 4 ? 2 : 1;
+
+  if (rsA == 1) {
+    for (int p=0; p<k; p+=GEMV_KB)
+      for (int i=i0; i<i1; i+=4*R)
+        small_tile( R, N, min(4*R, i1-i), min(GEMV_KB, k-p), alphaA, &alpha(i,p), csA, &beta(p,0), rsB, csB,
+                    p == 0 ? betaC : 1.0, &gamma(i,0), csC );
+  } else {
+    for (int p=0; p<k; p+=GEMV_DOT_KB) {
+      int pb = min(GEMV_DOT_KB, k-p), i = i0;
+      for (; i+R<=i1; i+=R)
+        gemv_dot( R, N, pb, alphaA, &alpha(i,p), rsA, &beta(p,0), csB, p == 0 ? betaC : 1.0, &gamma(i,0), rsC, csC );
+      for (; i<i1; i++)
+        gemv_dot( 1, N, pb, alphaA, &alpha(i,p), rsA, &beta(p,0), csB, p == 0 ? betaC : 1.0, &gamma(i,0), rsC, csC );
+    }
+  }
+}
+
+// C := alphaA AB + betaC C for n <= SKINNY_N. Needs A column-major with C column-major too, or A row-major with
+// B column-major, and returns 0 without doing anything otherwise
+static int gemm_gemv( int nthreads, int m, int n, int k, double alphaA, const double *A, int rsA, int csA,
+       const double *B, int rsB, int csB, double betaC, double *C, int rsC, int csC )
+
+{
+  (void) nthreads;   // only used by the pragma
+  if (!(rsA == 1 && rsC == 1) && !(csA == 1 && rsB == 1))
+    return 0;
+
+  #pragma omp parallel for num_threads(nthreads) schedule(static) if (2.0 * m * n * k > SKINNY_PARALLEL_FLOPS)
+  for (int i=0; i<m; i+=GEMV_MB) {
+    int i1 = min(i + GEMV_MB, m);
+    switch (n) {
+      case 1: gemv_rows( 1, i, i1, k, alphaA, A, rsA, csA, B, rsB, csB, betaC, C, rsC, csC ); break;
+      case 2: gemv_rows( 2, i, i1, k, alphaA, A, rsA, csA, B, rsB, csB, betaC, C, rsC, csC ); break;
+      case 3: gemv_rows( 3, i, i1, k, alphaA, A, rsA, csA, B, rsB, csB, betaC, C, rsC, csC ); break;
+      case 4: gemv_rows( 4, i, i1, k, alphaA, A, rsA, csA, B, rsB, csB, betaC, C, rsC, csC ); break;
+      case 5: gemv_rows( 5, i, i1, k, alphaA, A, rsA, csA, B, rsB, csB, betaC, C, rsC, csC ); break;
+      case 6: gemv_rows( 6, i, i1, k, alphaA, A, rsA, csA, B, rsB, csB, betaC, C, rsC, csC ); break;
+      case 7: gemv_rows( 7, i, i1, k, alphaA, A, rsA, csA, B, rsB, csB, betaC, C, rsC, csC ); break;
+      case 8: gemv_rows( 8, i, i1, k, alphaA, A, rsA, csA, B, rsB, csB, betaC, C, rsC, csC ); break;
+    }
+  }
+  return 1;
+}
+
+// Tries the paths for tiny and skinny shapes, in that order, and returns 0 if none of them took it
+static int gemm_shaped( fiveloops_ctx *ctx, int m, int n, int k, double alphaA, const double *A, int rsA, int csA,
+       const double *B, int rsB, int csB, double betaC, double *C, int rsC, int csC )
+
+{
+  if (is_small( m, n, k ) && gemm_small( 1, m, n, k, alphaA, A, rsA, csA, B, rsB, csB, betaC, C, rsC, csC ))
+    return 1;
+
+  int nt = ctx->nthreads;
+  if (k <= SKINNY_K && gemm_small( nt, m, n, k, alphaA, A, rsA, csA, B, rsB, csB, betaC, C, rsC, csC ))
+    return 1;
+
+  // Few rows is few columns of C^T = B^T A^T
+  if (n <= SKINNY_N && gemm_gemv( nt, m, n, k, alphaA, A, rsA, csA, B, rsB, csB, betaC, C, rsC, csC ))
+    return 1;
+  if (m <= SKINNY_N && gemm_gemv( nt, n, m, k, alphaA, B, csB, rsB, A, csA, rsA, betaC, C, csC, rsC ))
+    return 1;
+  return 0;
+}
+
+// The big multiplications can go to an accelerator (see fiveloops_set_offload) instead. The host still packs B,
+// a KC x NC panel at a time, just like the fifth and fourth loops would, and the backend takes the panels
+// as they are, so the device works from the same layout as the kernels. While the device copies over and
+// multiplies with one panel, the host packs the next into the context's other Bt.
+// Returns 0, with C left alone, if the call stays on the host: because it's too small, or the backend fails
+static int offload_gemm( fiveloops_ctx *ctx, int m, int n, int k, double alphaA, double *A, int rsA, int csA,
+       double *B, int rsB, int csB, double betaC, double *C, int rsC, int csC )
+
+{
+  const fiveloops_offload *o = offload;
+  if (!o || ctx->reproducible || 2.0 * m * n * k < offload_min_flops)
+    return 0;
+
+  if (!ctx->Bt_next)
+    ctx->Bt_next = arena_alloc(ctx->Bt_bytes);
+  if (!ctx->Bt_next)
+    return 0;
+
+  int nr = ctx->blk.nr, kc = ctx->blk.kc, nc = ctx->blk.nc;
+  double *Bt[2] = { ctx->Bt, ctx->Bt_next };
+
+  if (o->begin( o->user, m, n, k, nr, kc, nc, alphaA, A, rsA, csA, C, rsC, csC ))
+    return 0;
+
+  // The panels in the same order as fiveloops_streamed takes them; the q-th goes through slot q & 1
+  int ok = 1, q = 0;
+  for (int j=0; j<n && ok; j+=nc)
+    for (int p=0; p<k && ok; p+=kc, q++) {
+      int jb = min(nc, n-j), pb = min(kc, k-p), slot = q & 1;
+
+      if (q >= 2 && o->sync( o->user, slot )) {
+        ok = 0;
+        break;
+      }
+
+      #pragma omp parallel num_threads(ctx->nthreads)
+      packB_KCxNC( nr, pb, jb, &beta(p,j), rsB, csB, Bt[slot] );
+
+      ok = !o->panel( o->user, slot, j, p, jb, pb, Bt[slot], p == 0 ? betaC : 1.0 );
+    }
+
+  return !o->end( o->user, ok ) && ok;
+}
+
+static int gemm_stream_C( fiveloops_ctx *ctx, int m, int n, int k, double alphaA, double *A, int rsA, int csA,
+       double *B, int rsB, int csB, double betaC, double *C, int rsC, int csC );
+
+static void scale_C( int m, int n, double beta, double *C, int rsC, int csC );
+
+// C := alphaA AB + betaC C
+void fiveloops_scaled( fiveloops_ctx *ctx, int m, int n, int k, double alphaA, double *A, int rsA, int csA,
+       double *B, int rsB, int csB, double betaC, double *C, int rsC, int csC )
+
+{
+  // With k == 0 the loops never get as far as applying betaC (and the rank-k tiles would divide by it)
+  if (k <= 0 || alphaA == 0.0) {
+    scale_C( m, n, betaC, C, rsC, csC );
+    return;
+  }
+
+  // The kernels only write whole columns of C, so with C row-major every tile would go through ukernel_fringe.
+  // C^T = B^T A^T is the same multiplication with C column-major, and the packers don't mind the swap
+  if (csC == 1 && rsC != 1) {
+    fiveloops_scaled( ctx, n, m, k, alphaA, B, csB, rsB, A, csA, rsA, betaC, C, csC, rsC );
+    return;
+  }
+
+  if (gemm_shaped( ctx, m, n, k, alphaA, A, rsA, csA, B, rsB, csB, betaC, C, rsC, csC ))
+    return;
+
+  if (offload_gemm( ctx, m, n, k, alphaA, A, rsA, csA, B, rsB, csB, betaC, C, rsC, csC ))
+    return;
+
+  int levels = strassen_levels( m, n, k );
+  if (levels > 0)
+    fiveloops_strassen( ctx, levels, m, n, k, alphaA, A, rsA, csA, B, rsB, csB, betaC, C, rsC, csC );
+  else if (!gemm_stream_C( ctx, m, n, k, alphaA, A, rsA, csA, B, rsB, csB, betaC, C, rsC, csC ))
+    fiveloops_from( ctx, m, n, k, alphaA, A, rsA, csA, B, rsB, csB, NULL, betaC, C, rsC, csC );
+}
+
+// What fiveloops_scaled does, taking Bp (all of B, prepacked) instead of B if it is set
+static void fiveloops_from( fiveloops_ctx *ctx, int m, int n, int k, double alphaA, double *A, int rsA, int csA,
+       double *B, int rsB, int csB, const double *Bp, double betaC, double *C, int rsC, int csC )
+
+{
+  int nc = ctx->blk.nc, nr = ctx->blk.nr;
+
+  stats_begin(ctx);
+  STATS_START( t5 );
+
+  // On a NUMA host every node takes a range of B and C's columns (in proportion to its threads, and in whole
+  // NR panels), and runs the fifth loop over its range on its own, packing into its own, node-local Bt.
+  // A prepacked B already lives wherever it lives, so that (and any B too narrow to go round) stays below
+  if (ctx->nnodes > 1 && !Bp && n >= ctx->nnodes * nr) {
+    // The calling thread is node 0's first thread, and gets pinned with the rest; it's the application's
+    // own, though, so it gets its CPUs back afterwards. The OpenMP workers stay pinned, for the next call
+    cpu_set_t caller_cpus;
+    int restore = !sched_getaffinity(0, sizeof(cpu_set_t), &caller_cpus);
+    int levels = nest_begin();
+
+    #pragma omp parallel num_threads(ctx->nnodes)
+    {
+      int nd = omp_get_thread_num();
+      fiveloops_ctx *node = ctx->nodes[nd];
+      int before = 0;
+      for (int d=0; d<nd; d++)
+        before += ctx->nodes[d]->nthreads;
+      int j0 = (int) ((long) n * before / ctx->nthreads) / nr * nr;
+      int j1 = nd + 1 == ctx->nnodes ? n : (int) ((long) n * (before + node->nthreads) / ctx->nthreads) / nr * nr;
+
+      pin_to_node(node->node);
+      for (int j=j0; j<j1; j+=nc)
+        fourloops_from( node, m, min(nc, j1-j), k, alphaA, A, rsA, csA, &beta(0,j), rsB, csB, NULL,
+                        betaC, &gamma(0,j), rsC, csC );
+    }
+    nest_end(levels);
+
+    if (restore && pinned_node >= 0) {
+      sched_setaffinity(0, sizeof(cpu_set_t), &caller_cpus);
+      pinned_node = -1;
+    }
+
+    STATS_STOP( ctx, cycles_loop5, t5 );
+    stats_publish(ctx);
+    return;
+  }
+
+  int gj, gk;
+  if (!Bp && split_plan( ctx, m, n, k, &gj, &gk ) &&
+      fiveloops_split( ctx, gj, gk, m, n, k, alphaA, A, rsA, csA, B, rsB, csB, betaC, C, rsC, csC )) {
+    STATS_STOP( ctx, cycles_loop5, t5 );
+    stats_publish(ctx);
+    return;
+  }
+
+  // fifth loop - A is passed in completely, B and C are split up into NC column-wide chunks
+  for (int j=0; j<n; j+=nc) {
+
+    // This line allows for arbitrary-size matrices to be passed through, since NC is only an upper bound
+    int jb = min(nc, n-j);
+
+    // We were provided macros for matrix element access, eg
+    // #define alpha( i,j ) A[ (i)*rsA + (j)*csA ]
+    // So as to not clutter our code with references to matrix striding / pointer arithmetic.
+    // A prepacked B stores the NC blocks one after another, and every one before this is a full k x NC
+    fourloops_from( ctx, m, jb, k, alphaA, A, rsA, csA, Bp ? NULL : &beta(0,j), rsB, csB, Bp ? Bp + (size_t) j*k : NULL,
+                    betaC, &gamma(0,j), rsC, csC );
+  }
+
+  STATS_STOP( ctx, cycles_loop5, t5 );
+  stats_publish(ctx);
+}
+
+// Neither loop the threads normally split (the third, or the second, or both when stealing) has much to share
+// out when m and n are small: with T threads, every thread gets 1/T of the MR x NR tiles of each panel, and
+// once that's only a few tiles each, the barriers around packing every Bt panel cost more than the tiles
+// are worth. So those multiplications get split between groups of threads first, and every group runs
+// the loops as usual, with a Bt (and At's) of its own:
+//
+//  - over the fifth loop: with more than one NC block, each group takes a range of whole NC blocks,
+//  - over the fourth loop, when k is big: each group takes a range of whole KC panels, and adds its part
+//    into a C of its own (starting from zero), which get added onto C at the end. The first group works
+//    on C itself, betaC and all.
+//
+// which together with the (ic, jr) split inside each group makes all three of jc, pc and (ic, jr).
+// The groups get as many threads as there are to go round; enough of them that every thread gets at least
+// SPLIT_MIN_TILES tiles of each panel, but no more than there are NC blocks times k ranges of at least
+// SPLIT_MIN_PANELS KC panels each, and the partial C's can't take more than SPLIT_MAX_BYTES
+#define SPLIT_MIN_TILES  4
+#define SPLIT_MIN_PANELS 4
+#define SPLIT_MAX_BYTES  ((size_t) 256 << 20)
+
+// How many groups go over the NC blocks (gj) and how many over the KC panels (gk). 0 if it's not worth it
+static int split_plan( const fiveloops_ctx *ctx, int m, int n, int k, int *gj, int *gk )
+
+{
+  const fiveloops_blocking *b = &ctx->blk;
+  int nthreads = ctx->nthreads;
+
+  *gj = *gk = 1;
+  if (!ctx->use_split)
+    return 0;
+
+  long tiles = (long) ((m + b->mr - 1) / b->mr) * ((min(n, b->nc) + b->nr - 1) / b->nr);
+  if (tiles >= (long) SPLIT_MIN_TILES * nthreads)
+    return 0;
+
+  // Every group has all the tiles of its panels to share out, so g groups give each thread g times as many
+  int g = (int) min((long) nthreads, ((long) SPLIT_MIN_TILES * nthreads + tiles - 1) / tiles);
+  g = min(g, MAX_GROUPS);
+
+  *gj = min(g, (n + b->nc - 1) / b->nc);
+  int kranges = k / (b->kc * SPLIT_MIN_PANELS);
+  *gk = min((g + *gj - 1) / *gj, kranges > 1 && !ctx->reproducible && !ctx->ep ? kranges : 1);
+  while (*gk > 1 && (size_t) (*gk - 1) * m * n * sizeof(double) > SPLIT_MAX_BYTES)
+    (*gk)--;
+  while (*gj * *gk > g)
+    (*gk > 1 ? (*gk)-- : (*gj)--);
+  return *gj * *gk > 1;
+}
+
+// Makes sure there are ngroups groups, sharing out the context's threads, and room for nw partial C's of
+// m x n each. Returns 0 if that can't be had
+static int ctx_reserve_groups( fiveloops_ctx *ctx, int ngroups, size_t nw )
+
+{
+  if (ctx->ngroups != ngroups) {
+    for (int g=0; g<ctx->ngroups; g++)
+      fiveloops_ctx_free(ctx->groups[g]);
+    ctx->ngroups = 0;
+
+    for (int g=0; g<ngroups; g++) {
+      int share = ctx->nthreads / ngroups + (g < ctx->nthreads % ngroups);
+      ctx->groups[g] = ctx_create(share, ctx->kinfo, ctx->node, ctx->reproducible);
+      if (!ctx->groups[g])
+        return 0;
+      ctx->groups[g]->ep = ctx->ep;
+      ctx->ngroups = g + 1;
+    }
+  }
+
+  if (nw * sizeof(double) > ctx->Cw_bytes) {
+    arena_free(ctx->Cw, ctx->Cw_bytes);
+    ctx->Cw_bytes = round_up(nw * sizeof(double), ARENA_ALIGN);
+    ctx->Cw = arena_alloc(ctx->Cw_bytes);
+    if (!ctx->Cw) {
+      ctx->Cw_bytes = 0;
+      return 0;
+    }
+  }
+  return 1;
+}
+
+// fiveloops_from for the groups of split_plan. Returns 0, having done nothing, if the groups can't be had
+static int fiveloops_split( fiveloops_ctx *ctx, int gj, int gk, int m, int n, int k, double alphaA,
+       double *A, int rsA, int csA, double *B, int rsB, int csB, double betaC, double *C, int rsC, int csC )
+
+{
+  int nc = ctx->blk.nc, kc = ctx->blk.kc;
+  size_t mn = (size_t) m * n;
+
+  if (!ctx_reserve_groups( ctx, gj * gk, (gk - 1) * mn ))
+    return 0;
+
+  int blocks = (n + nc - 1) / nc, panels = (k + kc - 1) / kc;
+  int levels = nest_begin();
+
+  #pragma omp parallel num_threads(gj * gk)
+  {
+    int g = omp_get_thread_num(), gi = g / gk, gp = g % gk;
+    fiveloops_ctx *group = ctx->groups[g];
+
+    int j0 = blocks * gi / gj * nc, j1 = min(n, blocks * (gi+1) / gj * nc);
+    int p0 = panels * gp / gk * kc, p1 = min(k, panels * (gp+1) / gk * kc);
+
+    // The first k range goes into C itself, the others into their partial C's (column-major, m x n)
+    double *Cg = gp == 0 ? C : ctx->Cw + (gp - 1) * mn;
+    int rsCg = gp == 0 ? rsC : 1, csCg = gp == 0 ? csC : m;
+
+    for (int j=j0; j<j1; j+=nc)
+      fourloops_from( group, m, min(nc, j1-j), p1-p0, alphaA, &alpha(0,p0), rsA, csA, &beta(p0,j), rsB, csB, NULL,
+                      gp == 0 ? betaC : 0.0, &Cg[ (size_t) j*csCg ], rsCg, csCg );
+  }
+  nest_end(levels);
+
+  // Always in the same order, so the sums come out the same however the columns are shared out
+  if (gk > 1) {
+    #pragma omp parallel for num_threads(ctx->nthreads) schedule(static)
+    for (int j=0; j<n; j++)
+      for (int gp=1; gp<gk; gp++) {
+        const double *w = ctx->Cw + (gp - 1) * mn + (size_t) j*m;
+        for (int i=0; i<m; i++)
+          gamma(i,j) += w[i];
+      }
+  }
+  return 1;
+}
+
+// How the packing routines should step through a column-major matrix with leading dimension ld
+// to read it as it is ('N') or transposed
+static void op_strides( char trans, int ld, int *rs, int *cs )
+
+{
+  int transposed = trans != 'N' && trans != 'n';
+  *rs = transposed ? ld : 1;
+  *cs = transposed ? 1 : ld;
+}
+
+// C := beta C, for when there is nothing to multiply. beta == 0 gives exactly 0, whatever was in C before
+static void scale_C( int m, int n, double beta, double *C, int rsC, int csC )
+
+{
+  if (beta == 1.0)
+    return;
+  for (int j=0; j<n; j++)
+    for (int i=0; i<m; i++)
+      gamma(i,j) = beta == 0.0 ? 0.0 : beta * gamma(i,j);
+}
+
+/*
+ * The usual BLAS interface on top of the five loops: C := alpha op(A) op(B) + beta C,
+ * with all three matrices stored column-major
+ *
+    @param transA, transB 'N' to use A (B) as it is, 'T' (or 'C', which is the same thing for real matrices)
+                          to use its transpose
+    @param m, n, k        op(A) is m x k, op(B) is k x n, and C is m x n
+    @param lda, ldb, ldc  the leading dimensions, ie the distance between the columns of A, B and C as stored
+
+    A transpose costs nothing extra, it just swaps the row and column strides that the packing routines read
+    A and B with. alpha is applied while packing A and beta when the kernel first loads C (see dgemm_ukernel_packed),
+    so C is only read and written by the kernels, and beta == 0 means C isn't read at all
+*/
+void dgemm_ex( fiveloops_ctx *ctx, char transA, char transB, int m, int n, int k, double alpha, double *A, int lda,
+       double *B, int ldb, double beta, double *C, int ldc )
+
+{
+  if (m <= 0 || n <= 0)
+    return;
+
+  int rsA, csA, rsB, csB;
+  op_strides( transA, lda, &rsA, &csA );
+  op_strides( transB, ldb, &rsB, &csB );
+
+  // Nothing to multiply, but C still has to end up as beta C
+  if (k <= 0 || alpha == 0.0) {
+    scale_C( m, n, beta, C, 1, ldc );
+    return;
+  }
+
+  fiveloops_scaled( ctx, m, n, k, alpha, A, rsA, csA, B, rsB, csB, beta, C, 1, ldc );
+}
+
+void dgemm( char transA, char transB, int m, int n, int k, double alpha, double *A, int lda,
+       double *B, int ldb, double beta, double *C, int ldc )
+
+{
+  dgemm_ex( default_ctx(), transA, transB, m, n, k, alpha, A, lda, B, ldb, beta, C, ldc );
+}
+
+// A B that gets multiplied with many different A's only needs packing once. This is all of B in the format
+// fourloops packs Bt in, for every NC x KC block in turn, so the loops can read it straight from here.
+// It only makes sense to contexts that block the same way (nr, kc and nc) as the one it was packed for
+struct fiveloops_packed_B {
+  int k, n;
+  int nr, kc, nc;
+  double *Bt;
+  size_t Bt_bytes;
+};
+
+fiveloops_packed_B *fiveloops_pack_B( fiveloops_ctx *ctx, int k, int n, double *B, int rsB, int csB )
+
+{
+  fiveloops_packed_B *Bp = calloc(1, sizeof(*Bp));
+  if (!Bp)
+    return NULL;
+  Bp->k = k; Bp->n = n;
+  Bp->nr = ctx->blk.nr; Bp->kc = ctx->blk.kc; Bp->nc = ctx->blk.nc;
+  if (k <= 0 || n <= 0)
+    return Bp;
+
+  Bp->Bt_bytes = (size_t) k * round_up(n, Bp->nr) * sizeof(double);
+  Bp->Bt = arena_alloc(Bp->Bt_bytes);
+  if (!Bp->Bt) {
+    free(Bp);
+    return NULL;
+  }
+
+  // Same order as the fifth and fourth loops would pack it in, and shared out between the threads the same way
+  int nr = Bp->nr, kc = Bp->kc, nc = Bp->nc;
+  #pragma omp parallel num_threads(ctx->nthreads)
+  for (int j=0; j<n; j+=nc) {
+    int jb = min(nc, n-j);
+    for (int p=0; p<k; p+=kc)
+      packB_KCxNC( nr, min(kc, k-p), jb, &beta(p,j), rsB, csB, Bp->Bt + (size_t) j*k + (size_t) p * round_up(jb, nr) );
+  }
+  return Bp;
+}
+
+// The same for the dgemm interface, blocked like the default context
+fiveloops_packed_B *dgemm_pack_B( char transB, int k, int n, double *B, int ldb )
+
+{
+  int rsB, csB;
+  op_strides( transB, ldb, &rsB, &csB );
+  return fiveloops_pack_B( default_ctx(), k, n, B, rsB, csB );
+}
+
+void fiveloops_packed_B_free( fiveloops_packed_B *Bp )
+
+{
+  if (!Bp)
+    return;
+  arena_free(Bp->Bt, Bp->Bt_bytes);
+  free(Bp);
+}
+
+// C := alphaA A Bp + betaC C, where A is m x Bp->k. Returns -1 without touching C
+// if Bp was packed for a context that blocks differently from this one
+int fiveloops_scaled_packed( fiveloops_ctx *ctx, int m, double alphaA, double *A, int rsA, int csA,
+       const fiveloops_packed_B *Bp, double betaC, double *C, int rsC, int csC )
+
+{
+  if (Bp->nr != ctx->blk.nr || Bp->kc != ctx->blk.kc || Bp->nc != ctx->blk.nc)
+    return -1;
+
+  if (m <= 0 || Bp->n <= 0)
+    return 0;
+  if (Bp->k <= 0 || alphaA == 0.0) {
+    scale_C( m, Bp->n, betaC, C, rsC, csC );
+    return 0;
+  }
+
+  fiveloops_from( ctx, m, Bp->n, Bp->k, alphaA, A, rsA, csA, NULL, 0, 0, Bp->Bt, betaC, C, rsC, csC );
+  return 0;
+}
+
+// C := alpha op(A) Bp + beta C, column-major, with Bp from dgemm_pack_B
+int dgemm_packed( char transA, int m, double alpha, double *A, int lda,
+       const fiveloops_packed_B *Bp, double beta, double *C, int ldc )
+
+{
+  int rsA, csA;
+  op_strides( transA, lda, &rsA, &csA );
+  return fiveloops_scaled_packed( default_ctx(), m, alpha, A, rsA, csA, Bp, beta, C, 1, ldc );
+}
+
+// Matrices too big for memory, eg mmap'ed from files on disk, are better off streamed: the loops go through
+// B (and C) exactly once anyway, one KC x NC panel at a time, and through all of A once per panel. So while the
+// threads compute on one panel, a helper thread reads the next panel of B in from disk and packs it into
+// the other Bt, and tells the kernel to start reading in the block of A (and of C) that panel will need.
+// Waiting on the disk then overlaps with the compute instead of adding to it
+struct stream_panel {
+  int nr, m, n, k;
+  double *B; int rsB, csB;
+  double *Bt;
+  double *A; int rsA, csA;    // the m x k block of A that goes with it
+  double *C; int rsC, csC;    // and the m x n block of C, when this is the first panel of its NC block
+};
+
+static void will_need_range( const double *p, size_t bytes )
+
+{
+  size_t start = (size_t) p / PAGE_BYTES * PAGE_BYTES;
+  madvise((void *) start, (size_t) p + bytes - start, MADV_WILLNEED);
+}
+
+// Asks the kernel to start reading in the rows x cols matrix X, one contiguous run at a time
+static void will_need( const double *X, int rsX, int csX, int rows, int cols )
+
+{
+  if (rsX == 1)
+    for (int j=0; j<cols; j++)
+      will_need_range( &X[ (long) j*csX ], rows * sizeof(double) );
+  else if (csX == 1)
+    for (int i=0; i<rows; i++)
+      will_need_range( &X[ (long) i*rsX ], cols * sizeof(double) );
+  else
+    will_need_range( X, ((long) (rows-1)*rsX + (long) (cols-1)*csX + 1) * sizeof(double) );
+}
+
+static void *stream_pack( void *arg )
+
+{
+  struct stream_panel *sp = arg;
+
+  will_need( sp->B, sp->rsB, sp->csB, sp->k, sp->n );
+  will_need( sp->A, sp->rsA, sp->csA, sp->m, sp->k );
+  if (sp->C)
+    will_need( sp->C, sp->rsC, sp->csC, sp->m, sp->n );
+
+  // Outside of any parallel region, so this thread packs it all by itself
+  packB_KCxNC( sp->nr, sp->k, sp->n, sp->B, sp->rsB, sp->csB, sp->Bt );
+  return NULL;
+}
+
+// C := alphaA AB + betaC C like fiveloops_scaled, but with the next panel of B read in and packed by a helper
+// thread while the current one computes (see stream_panel). Returns -1 without touching C if the
+// second Bt can't be mapped
+int fiveloops_streamed( fiveloops_ctx *ctx, int m, int n, int k, double alphaA, double *A, int rsA, int csA,
+       double *B, int rsB, int csB, double betaC, double *C, int rsC, int csC )
+
+{
+  if (m <= 0 || n <= 0)
+    return 0;
+  if (k <= 0 || alphaA == 0.0) {
+    scale_C( m, n, betaC, C, rsC, csC );
+    return 0;
+  }
+
+  if (!ctx->Bt_next)
+    ctx->Bt_next = arena_alloc(ctx->Bt_bytes);
+  if (!ctx->Bt_next)
+    return -1;
+
+  int nr = ctx->blk.nr, kc = ctx->blk.kc, nc = ctx->blk.nc;
+  double *Bt[2] = { ctx->Bt, ctx->Bt_next };
+  struct stream_panel sp[2];
+
+  stats_begin(ctx);
+  STATS_START( t5 );
+
+  // The panels in the order the fifth and fourth loops take them: (j, p) is the q-th
+  int jq = 0, pq = 0;
+  for (int q=0; jq<n; q++) {
+    int j = jq, p = pq, jb = min(nc, n-j), pb = min(kc, k-p);
+    if ((pq += kc) >= k) {
+      pq = 0;
+      jq += nc;
+    }
+
+    if (q == 0) {
+      sp[0] = (struct stream_panel) { nr, m, jb, pb, &beta(p,j), rsB, csB, Bt[0], &alpha(0,p), rsA, csA,
+                                      &gamma(0,j), rsC, csC };
+      stream_pack(&sp[0]);
+    }
+
+    // Panel q is packed; get the helper going on q+1 (or do it afterwards, if there's no thread to be had)
+    pthread_t helper;
+    int next = jq < n, helping = 0;
+    if (next) {
+      struct stream_panel *np = &sp[ (q+1) & 1 ];
+      int njb = min(nc, n-jq);
+      *np = (struct stream_panel) { nr, m, njb, min(kc, k-pq), &beta(pq,jq), rsB, csB, Bt[ (q+1) & 1 ],
+                                    &alpha(0,pq), rsA, csA, pq == 0 ? &gamma(0,jq) : NULL, rsC, csC };
+      helping = !pthread_create(&helper, NULL, stream_pack, np);
+    }
+
+    fourloops_from( ctx, m, jb, pb, alphaA, &alpha(0,p), rsA, csA, NULL, 0, 0, Bt[ q & 1 ],
+                    p == 0 ? betaC : 1.0, &gamma(0,j), rsC, csC );
+
+    if (helping)
+      pthread_join(helper, NULL);
+    else if (next)
+      stream_pack(&sp[ (q+1) & 1 ]);
+  }
+
+  STATS_STOP( ctx, cycles_loop5, t5 );
+  stats_publish(ctx);
+  return 0;
+}
+
+// The same, column-major and with the default context, like dgemm
+int dgemm_streamed( char transA, char transB, int m, int n, int k, double alpha, double *A, int lda,
+       double *B, int ldb, double beta, double *C, int ldc )
+
+{
+  int rsA, csA, rsB, csB;
+  op_strides( transA, lda, &rsA, &csA );
+  op_strides( transB, ldb, &rsB, &csB );
+  return fiveloops_streamed( default_ctx(), m, n, k, alpha, A, rsA, csA, B, rsB, csB, beta, C, 1, ldc );
+}
+
+// Maps the first bytes of the file at path, to be passed to fiveloops_streamed as a matrix. Writable mappings
+// (for C) are shared, so what gets written goes back to the file, which is created or grown as needed.
+// NULL if the file can't be opened or mapped
+double *fiveloops_map_file( const char *path, size_t bytes, int writable )
+
+{
+  int fd = open(path, writable ? O_RDWR | O_CREAT : O_RDONLY, 0644);
+  if (fd < 0)
+    return NULL;
+
+  off_t size = lseek(fd, 0, SEEK_END);
+  if (size < (off_t) bytes && (!writable || ftruncate(fd, bytes) != 0)) {
+    close(fd);
+    return NULL;
+  }
+
+  void *p = mmap(NULL, bytes, writable ? PROT_READ | PROT_WRITE : PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  return p == MAP_FAILED ? NULL : p;
+}
+
+void fiveloops_unmap_file( double *p, size_t bytes )
+
+{
+  if (p)
+    munmap(p, bytes);
+}
+
+// Asynchronous calls go into a queue, and the queue's workers take them out and run them, each worker on a
+// context of its own. A job can wait for other jobs first (its "after" list), and a multiplication with a
+// packed B (from fiveloops_submit_pack_B) also waits for the packing. Workers take the first job in
+// submission order whose dependencies are done, so with two workers or more, packing the B of the next
+// request overlaps with the multiplication of the current one.
+//
+// A future stays around for as long as someone needs it: whoever submitted it (until fiveloops_future_free),
+// the queue (until it's done), and every job that waits for it (until that one is done)
+enum { JOB_GEMM, JOB_PACK_B, JOB_PACKED };
+enum { JOB_QUEUED, JOB_RUNNING, JOB_DONE };
+
+struct fiveloops_future {
+  fiveloops_queue *q;
+  fiveloops_future *next;     // the next job still queued, in submission order
+
+  int kind;
+  int m, n, k;
+  double alphaA, *A; int rsA, csA;
+  double *B; int rsB, csB;
+  double betaC, *C; int rsC, csC;
+
+  fiveloops_future **after;   // everything this job waits for, including the packing of its B
+  int nafter;
+  fiveloops_future *packed;   // for JOB_PACKED, the job packing its B (also in after)
+
+  int state, status, refs;
+  fiveloops_packed_B *Bp;     // what JOB_PACK_B packed
+  fiveloops_done_callback cb;
+  void *user;
+};
+
+struct fiveloops_queue {
+  pthread_mutex_t lock;
+  pthread_cond_t work;        // signalled when a job is queued or finishes (and so may unblock another)
+  pthread_cond_t done;        // broadcast whenever a job finishes
+  fiveloops_future *head, *tail;
+  int pending;                // queued or running
+  int stopping;
+
+  int nworkers;
+  pthread_t *workers;
+  fiveloops_ctx **ctx;
+};
+
+// Needs q->lock
+static void future_release( fiveloops_future *f )
+
+{
+  if (--f->refs > 0)
+    return;
+  free(f->after);
+  free(f);
+}
+
+// The first queued job that can run now (unlinked from the queue), NULL if there is none. Needs q->lock
+static fiveloops_future *queue_take( fiveloops_queue *q )
+
+{
+  for (fiveloops_future **pf = &q->head, *prev = NULL; *pf; prev = *pf, pf = &(*pf)->next) {
+    fiveloops_future *f = *pf;
+    int ready = 1;
+    for (int d=0; d<f->nafter && ready; d++)
+      ready = f->after[d]->state == JOB_DONE;
+    if (!ready)
+      continue;
+
+    *pf = f->next;
+    if (q->tail == f)
+      q->tail = prev;
+    f->next = NULL;
+    return f;
+  }
+  return NULL;
+}
+
+static void job_run( fiveloops_ctx *ctx, fiveloops_future *f )
+
+{
+  // Anything that went wrong before this job means it doesn't run, and leaves its C alone
+  for (int d=0; d<f->nafter; d++)
+    if (f->after[d]->status != 0) {
+      f->status = -1;
+      return;
+    }
+
+  switch (f->kind) {
+  case JOB_PACK_B:
+    f->Bp = fiveloops_pack_B( ctx, f->k, f->n, f->B, f->rsB, f->csB );
+    f->status = f->Bp ? 0 : -1;
+    break;
+  case JOB_PACKED:
+    f->status = fiveloops_scaled_packed( ctx, f->m, f->alphaA, f->A, f->rsA, f->csA, f->packed->Bp,
+                                         f->betaC, f->C, f->rsC, f->csC );
+    break;
+  default:
+    if (f->m <= 0 || f->n <= 0)
+      break;
+    if (f->k <= 0 || f->alphaA == 0.0)
+      scale_C( f->m, f->n, f->betaC, f->C, f->rsC, f->csC );
+    else
+      fiveloops_scaled( ctx, f->m, f->n, f->k, f->alphaA, f->A, f->rsA, f->csA, f->B, f->rsB, f->csB,
+                        f->betaC, f->C, f->rsC, f->csC );
+  }
+}
+
+struct queue_worker { fiveloops_queue *q; fiveloops_ctx *ctx; };
+
+static void *queue_worker( void *arg )
+
+{
+  fiveloops_queue *q = ((struct queue_worker *) arg)->q;
+  fiveloops_ctx *ctx = ((struct queue_worker *) arg)->ctx;
+  free(arg);
+
+  pthread_mutex_lock(&q->lock);
+  for (;;) {
+    fiveloops_future *f = queue_take(q);
+    if (!f) {
+      if (q->stopping && !q->pending)
+        break;
+      pthread_cond_wait(&q->work, &q->lock);
+      continue;
+    }
+
+    f->state = JOB_RUNNING;
+    pthread_mutex_unlock(&q->lock);
+    job_run(ctx, f);
+    pthread_mutex_lock(&q->lock);
+
+    // Whoever sees the job done first calls the callback: us, or fiveloops_future_on_done
+    f->state = JOB_DONE;
+    fiveloops_done_callback cb = f->cb;
+    f->cb = NULL;
+    q->pending--;
+    pthread_cond_broadcast(&q->work);
+    pthread_cond_broadcast(&q->done);
+    if (cb) {
+      pthread_mutex_unlock(&q->lock);
+      cb(f, f->user);
+      pthread_mutex_lock(&q->lock);
+    }
+
+    for (int d=0; d<f->nafter; d++)
+      future_release(f->after[d]);
+    future_release(f);
+  }
+  pthread_mutex_unlock(&q->lock);
+  return NULL;
+}
+
+// Waits for everything submitted so far, then stops the workers. Free the futures first
+void fiveloops_queue_free( fiveloops_queue *q )
+
+{
+  if (!q)
+    return;
+
+  pthread_mutex_lock(&q->lock);
+  q->stopping = 1;
+  pthread_cond_broadcast(&q->work);
+  pthread_mutex_unlock(&q->lock);
+
+  for (int w=0; w<q->nworkers; w++)
+    pthread_join(q->workers[w], NULL);
+  for (int w=0; w<q->nworkers; w++)
+    fiveloops_ctx_free(q->ctx[w]);
+
+  pthread_cond_destroy(&q->done);
+  pthread_cond_destroy(&q->work);
+  pthread_mutex_destroy(&q->lock);
+  free(q->workers);
+  free(q->ctx);
+  free(q);
+}
+
+// workers threads taking jobs off the queue, each running the loops on nthreads threads of its own
+// (0 for the default, like fiveloops_ctx_create). NULL if the threads or their buffers can't be had
+fiveloops_queue *fiveloops_queue_create( int workers, int nthreads )
+
+{
+  fiveloops_queue *q = calloc(1, sizeof(*q));
+  if (!q)
+    return NULL;
+  pthread_mutex_init(&q->lock, NULL);
+  pthread_cond_init(&q->work, NULL);
+  pthread_cond_init(&q->done, NULL);
+
+  workers = workers > 0 ? workers : 1;
+  q->workers = calloc(workers, sizeof(pthread_t));
+  q->ctx = calloc(workers, sizeof(fiveloops_ctx *));
+  if (!q->workers || !q->ctx) {
+    fiveloops_queue_free(q);
+    return NULL;
+  }
+
+  // Every worker blocks the same way, so B packed by one can be used by all the others
+  for (; q->nworkers<workers; q->nworkers++) {
+    struct queue_worker *arg = malloc(sizeof(*arg));
+    q->ctx[ q->nworkers ] = fiveloops_ctx_create(nthreads);
+    if (!arg || !q->ctx[ q->nworkers ]) {
+      free(arg);
+      fiveloops_ctx_free(q->ctx[ q->nworkers ]);
+      fiveloops_queue_free(q);
+      return NULL;
+    }
+    *arg = (struct queue_worker) { q, q->ctx[ q->nworkers ] };
+    if (pthread_create(&q->workers[ q->nworkers ], NULL, queue_worker, arg)) {
+      free(arg);
+      fiveloops_ctx_free(q->ctx[ q->nworkers ]);
+      fiveloops_queue_free(q);
+      return NULL;
+    }
+  }
+  return q;
+}
+
+// Queues f (already filled in, apart from its dependencies) to run after everything in after[0..nafter)
+// (NULL entries are skipped, and the rest have to be from the same queue) and after packed, if that is set. NULL, with f gone, if out of memory
+static fiveloops_future *queue_submit( fiveloops_queue *q, fiveloops_future *f, fiveloops_future *packed,
+       fiveloops_future *const *after, int nafter )
+
+{
+  f->q = q;
+  f->after = malloc(sizeof(fiveloops_future *) * (nafter + 1));
+  if (!f->after) {
+    free(f);
+    return NULL;
+  }
+  for (int d=0; d<nafter; d++)
+    if (after[d])
+      f->after[ f->nafter++ ] = after[d];
+  if (packed)
+    f->after[ f->nafter++ ] = f->packed = packed;
+
+  pthread_mutex_lock(&q->lock);
+  for (int d=0; d<f->nafter; d++)
+    f->after[d]->refs++;
+  f->refs = 2;                // the caller's and the queue's
+  f->state = JOB_QUEUED;
+  if (q->tail)
+    q->tail->next = f;
+  else
+    q->head = f;
+  q->tail = f;
+  q->pending++;
+  pthread_cond_signal(&q->work);
+  pthread_mutex_unlock(&q->lock);
+  return f;
+}
+
+// C := alphaA AB + betaC C like fiveloops_scaled, once everything in after is done. The matrices have to
+// stay put until then. NULL if out of memory
+fiveloops_future *fiveloops_submit( fiveloops_queue *q, int m, int n, int k, double alphaA, double *A, int rsA, int csA,
+       double *B, int rsB, int csB, double betaC, double *C, int rsC, int csC,
+       fiveloops_future *const *after, int nafter )
+
+{
+  fiveloops_future *f = calloc(1, sizeof(*f));
+  if (!f)
+    return NULL;
+  *f = (fiveloops_future) { .kind = JOB_GEMM, .m = m, .n = n, .k = k, .alphaA = alphaA, .A = A, .rsA = rsA, .csA = csA,
+                            .B = B, .rsB = rsB, .csB = csB, .betaC = betaC, .C = C, .rsC = rsC, .csC = csC };
+  return queue_submit( q, f, NULL, after, nafter );
+}
+
+// Packs the k x n matrix B like fiveloops_pack_B, for the multiplications in fiveloops_submit_packed.
+// The packed B belongs to the caller, who gets it from fiveloops_future_packed_B
+fiveloops_future *fiveloops_submit_pack_B( fiveloops_queue *q, int k, int n, double *B, int rsB, int csB,
+       fiveloops_future *const *after, int nafter )
+
+{
+  fiveloops_future *f = calloc(1, sizeof(*f));
+  if (!f)
+    return NULL;
+  *f = (fiveloops_future) { .kind = JOB_PACK_B, .k = k, .n = n, .B = B, .rsB = rsB, .csB = csB };
+  return queue_submit( q, f, NULL, after, nafter );
+}
+
+// C := alphaA A Bp + betaC C like fiveloops_scaled_packed, with Bp what packed packs, once it has
+fiveloops_future *fiveloops_submit_packed( fiveloops_queue *q, int m, double alphaA, double *A, int rsA, int csA,
+       fiveloops_future *packed, double betaC, double *C, int rsC, int csC,
+       fiveloops_future *const *after, int nafter )
+
+{
+  fiveloops_future *f = calloc(1, sizeof(*f));
+  if (!f)
+    return NULL;
+  *f = (fiveloops_future) { .kind = JOB_PACKED, .m = m, .alphaA = alphaA, .A = A, .rsA = rsA, .csA = csA,
+                            .betaC = betaC, .C = C, .rsC = rsC, .csC = csC };
+  return queue_submit( q, f, packed, after, nafter );
+}
+
+// Waits for f; 0 if it ran, -1 if it (or anything it waited for) failed
+int fiveloops_future_wait( fiveloops_future *f )
+
+{
+  fiveloops_queue *q = f->q;
+  pthread_mutex_lock(&q->lock);
+  while (f->state != JOB_DONE)
+    pthread_cond_wait(&q->done, &q->lock);
+  pthread_mutex_unlock(&q->lock);
+  return f->status;
+}
+
+int fiveloops_future_done( fiveloops_future *f )
+
+{
+  pthread_mutex_lock(&f->q->lock);
+  int done = f->state == JOB_DONE;
+  pthread_mutex_unlock(&f->q->lock);
+  return done;
+}
+
+// cb gets called once f is done, on the worker that ran it, or right away (on this thread) if it already is
+void fiveloops_future_on_done( fiveloops_future *f, fiveloops_done_callback cb, void *user )
+
+{
+  pthread_mutex_lock(&f->q->lock);
+  int done = f->state == JOB_DONE;
+  if (!done) {
+    f->cb = cb;
+    f->user = user;
+  }
+  pthread_mutex_unlock(&f->q->lock);
+  if (done)
+    cb(f, user);
+}
+
+// What a fiveloops_submit_pack_B job packed, once it is done (NULL before, or if it failed)
+fiveloops_packed_B *fiveloops_future_packed_B( fiveloops_future *f )
+
+{
+  return fiveloops_future_done(f) ? f->Bp : NULL;
+}
+
+// Lets go of f. That doesn't cancel it: if it hasn't run yet, it still will
+void fiveloops_future_free( fiveloops_future *f )
+
+{
+  if (!f)
+    return;
+  fiveloops_queue *q = f->q;
+  pthread_mutex_lock(&q->lock);
+  future_release(f);
+  pthread_mutex_unlock(&q->lock);
+}
+
+static void twoloops_packA( fiveloops_ctx *ctx, int m, int n, int k, double alphaA, double *A, int rsA, int csA,
+       double *At, double *Bt, double betaC, double *C, int rsC, int csC );
+
+// A whole multiplication that fits in one MC x KC x NC block, done by the calling thread alone:
+// no blocking loops, just pack all of B and all of A once and run the second loop over them.
+// Unlike packB_KCxNC this doesn't share the packing out, so it is safe to call from inside a worksharing loop
+static void gemm_oneblock( fiveloops_ctx *ctx, int m, int n, int k, double alphaA, double *A, int rsA, int csA,
+       double *B, int rsB, int csB, double betaC, double *C, int rsC, int csC, double *At, double *Bt )
+
+{
+  int nr = ctx->blk.nr;
+
+  STATS_START( tB );
+  for (int j=0; j<n; j+=nr)
+    packB_KCxNR( nr, k, min(nr, n-j), &beta(0,j), rsB, csB, &Bt[ j*k ] );
+  STATS_STOP( ctx, cycles_pack_B, tB );
+  STATS_ADD( ctx, bytes_packed_B, (unsigned long long) k * round_up(n, nr) * sizeof(double) );
+
+  twoloops_packA( ctx, m, n, k, alphaA, A, rsA, csA, At, Bt, betaC, C, rsC, csC );
+}
+
+// The five loops only pay off for big matrices: for a batch of small ones every call would go through all
+// the blocking arithmetic and a parallel region just to pack and multiply a single block. So when the
+// matrices fit in one block each thread takes whole batch entries instead, packing them into its own At and
+// its own (small) Bt. Bigger matrices just go through dgemm_ex one after the other, each using all the threads.
+// Either A_list[i] or A + i*strideA is the i'th A, and the same for B and C
+static void dgemm_batch( fiveloops_ctx *ctx, char transA, char transB, int m, int n, int k, double alpha,
+       double **A_list, double *A, long strideA, int lda, double **B_list, double *B, long strideB, int ldb,
+       double beta, double **C_list, double *C, long strideC, int ldc, int batch )
+
+{
+  if (m <= 0 || n <= 0 || batch <= 0)
+    return;
+
+  const fiveloops_blocking *b = &ctx->blk;
+  int one_block = m <= b->mc && k <= b->kc && n <= b->nc && k > 0 && alpha != 0.0;
+
+  if (!one_block || !ctx_reserve_thread_Bt( ctx, (size_t) k * round_up(n, b->nr) )) {
+    for (int e=0; e<batch; e++)
+      dgemm_ex( ctx, transA, transB, m, n, k, alpha, A_list ? A_list[e] : A + e*strideA, lda,
+                B_list ? B_list[e] : B + e*strideB, ldb, beta, C_list ? C_list[e] : C + e*strideC, ldc );
+    return;
+  }
+
+  int rsA, csA, rsB, csB;
+  op_strides( transA, lda, &rsA, &csA );
+  op_strides( transB, ldb, &rsB, &csB );
+
+  stats_begin(ctx);
+  STATS_START( t5 );
+
+  int small = is_small( m, n, k );
+
+  #pragma omp parallel for num_threads(ctx->nthreads) schedule(dynamic)
+  for (int e=0; e<batch; e++) {
+    int t = omp_get_thread_num();
+    if (small && gemm_small( 1, m, n, k, alpha, A_list ? A_list[e] : A + e*strideA, rsA, csA,
+                             B_list ? B_list[e] : B + e*strideB, rsB, csB, beta,
+                             C_list ? C_list[e] : C + e*strideC, 1, ldc ))
+      continue;
+    gemm_oneblock( ctx, m, n, k, alpha, A_list ? A_list[e] : A + e*strideA, rsA, csA,
+                   B_list ? B_list[e] : B + e*strideB, rsB, csB, beta, C_list ? C_list[e] : C + e*strideC, 1, ldc,
+                   ctx->At + t*ctx->At_stride, ctx->Bt_thread + t*ctx->Bt_thread_stride );
+  }
+
+  STATS_STOP( ctx, cycles_loop5, t5 );
+  stats_publish(ctx);
+}
+
+/*
+ * C[i] := alpha op(A[i]) op(B[i]) + beta C[i] for i = 0 .. batch-1, every one of them with the same
+ * dimensions and leading dimensions (see dgemm for the rest of the parameters)
+ *
+    @params A, B, C       arrays of batch pointers to the individual matrices
+*/
+void dgemm_batched_ex( fiveloops_ctx *ctx, char transA, char transB, int m, int n, int k, double alpha,
+       double **A, int lda, double **B, int ldb, double beta, double **C, int ldc, int batch )
+
+{
+  dgemm_batch( ctx, transA, transB, m, n, k, alpha, A, NULL, 0, lda, B, NULL, 0, ldb, beta, C, NULL, 0, ldc, batch );
+}
+
+void dgemm_batched( char transA, char transB, int m, int n, int k, double alpha,
+       double **A, int lda, double **B, int ldb, double beta, double **C, int ldc, int batch )
+
+{
+  dgemm_batched_ex( default_ctx(), transA, transB, m, n, k, alpha, A, lda, B, ldb, beta, C, ldc, batch );
+}
+
+/*
+ * Same as dgemm_batched for matrices that sit at regular intervals in memory:
+ *
+    @params strideA, strideB, strideC  how many doubles apart the i'th and the (i+1)'th A, B and C start
 */
+void dgemm_strided_batched_ex( fiveloops_ctx *ctx, char transA, char transB, int m, int n, int k, double alpha,
+       double *A, int lda, long strideA, double *B, int ldb, long strideB, double beta,
+       double *C, int ldc, long strideC, int batch )
+
+{
+  dgemm_batch( ctx, transA, transB, m, n, k, alpha, NULL, A, strideA, lda, NULL, B, strideB, ldb,
+               beta, NULL, C, strideC, ldc, batch );
+}
+
+void dgemm_strided_batched( char transA, char transB, int m, int n, int k, double alpha,
+       double *A, int lda, long strideA, double *B, int ldb, long strideB, double beta,
+       double *C, int ldc, long strideC, int batch )
+
+{
+  dgemm_strided_batched_ex( default_ctx(), transA, transB, m, n, k, alpha, A, lda, strideA, B, ldb, strideB,
+                            beta, C, ldc, strideC, batch );
+}
+
+// fourth loop - C is passed in completely, A is split up into KC column-wide chunks,
+// B is buffered into Bt (temporarily)
+void fourloops( fiveloops_ctx *ctx, int m, int n, int k, double alphaA, double *A, int rsA, int csA,
+       double *B, int rsB, int csB, double betaC, double *C, int rsC, int csC )
+
+{
+  fourloops_from( ctx, m, n, k, alphaA, A, rsA, csA, B, rsB, csB, NULL, betaC, C, rsC, csC );
+}
+
+// ---- Fused epilogues -----------------------------------------------------------------------------------------
+// A bias and an activation are cheap to apply to C, but a pass of their own after the multiplication has
+// to read all of C back in from memory and write it out again. fiveloops_scaled_epilogue applies them as
+// the tiles get stored instead, on the last KC panel, when every tile of C is complete for the first time:
+// the kernel computes the tile into a buffer (still in L1, like in ukernel_fringe), and ep_store adds
+// betaC C and the biases, applies the activation and writes that to C, so C only goes through once.
+//
+// The epilogue reaches oneloop through the context (ep, set for the length of the call) and the thread's
+// ep_panel, which fourloops_from points at it for the last panel only. It doesn't go through the loops
+// as an argument, so oneloop has to work out where a tile is from where in C it is: e->C is the whole of C,
+// column-major with leading dimension e->csC.
+//
+// The same path also streams C out when it's only being written (see stream_C). A normal store to a line
+// that isn't in cache has to read it in first, so writing out a C that doesn't fit in cache costs twice its
+// size in memory traffic; streaming stores skip the read (and the caches). With stream set, ep_store writes
+// C with streaming stores, and without an epilogue (ep NULL) the full tiles skip Ct altogether: the kernel's
+// _nt variant streams them out of its registers itself
+
+// e^x, to about an ulp for |x| < 708: x = n ln2 + r with |r| <= ln2/2, and e^r from its Taylor series
+// (up to r^12, past which the terms are below the last bit), scaled by 2^n through the exponent bits
+static inline __attribute__((always_inline)) __m256d exp_pd( __m256d x )
+
+{
+  const __m256d magic = _mm256_set1_pd(6755399441055744.0);   // 2^52 + 2^51: adding it rounds to an integer
+  x = _mm256_min_pd(_mm256_max_pd(x, _mm256_set1_pd(-708.0)), _mm256_set1_pd(708.0));
+
+  __m256d n = _mm256_round_pd(_mm256_mul_pd(x, _mm256_set1_pd(1.4426950408889634)),
+                              _MM_FROUND_TO_NEAREST_INT | _MM_FROUND_NO_EXC);
+  __m256d r = _mm256_fnmadd_pd(n, _mm256_set1_pd(6.93147180369123816490e-01), x);
+  r = _mm256_fnmadd_pd(n, _mm256_set1_pd(1.90821492927058770002e-10), r);
+
+  // Estrin's scheme rather than Horner's, so that it's a few FMAs deep instead of twelve
+  #define C_( i, f ) const __m256d c##i = _mm256_set1_pd( 1.0 / f )
+  C_( 0, 1 ); C_( 1, 1 ); C_( 2, 2 ); C_( 3, 6 ); C_( 4, 24 ); C_( 5, 120 ); C_( 6, 720 ); C_( 7, 5040 );
+  C_( 8, 40320 ); C_( 9, 362880 ); C_( 10, 3628800 ); C_( 11, 39916800 ); C_( 12, 479001600 );
+  #undef C_
+  __m256d r2 = _mm256_mul_pd(r, r), r4 = _mm256_mul_pd(r2, r2), r8 = _mm256_mul_pd(r4, r4);
+  __m256d s0 = _mm256_fmadd_pd(_mm256_fmadd_pd(c3, r, c2), r2, _mm256_fmadd_pd(c1, r, c0));
+  __m256d s1 = _mm256_fmadd_pd(_mm256_fmadd_pd(c7, r, c6), r2, _mm256_fmadd_pd(c5, r, c4));
+  __m256d s2 = _mm256_fmadd_pd(_mm256_fmadd_pd(c11, r, c10), r2, _mm256_fmadd_pd(c9, r, c8));
+  __m256d p = _mm256_fmadd_pd(_mm256_fmadd_pd(c12, r4, s2), r8, _mm256_fmadd_pd(s1, r4, s0));
+
+  __m256i e = _mm256_sub_epi64(_mm256_castpd_si256(_mm256_add_pd(n, magic)), _mm256_castpd_si256(magic));
+  e = _mm256_slli_epi64(_mm256_add_epi64(e, _mm256_set1_epi64x(1023)), 52);
+  return _mm256_mul_pd(p, _mm256_castsi256_pd(e));
+}
+
+// GELU is the tanh approximation, x (1 + tanh u) / 2 with u = sqrt(2/pi) (x + 0.044715 x^3),
+// which comes to x / (1 + e^-2u)
+static inline __attribute__((always_inline)) __m256d activate( int act, __m256d v )
+
+{
+  if (act == FIVELOOPS_ACT_RELU)
+    return _mm256_max_pd(v, _mm256_setzero_pd());
+  if (act == FIVELOOPS_ACT_GELU) {
+    __m256d v3 = _mm256_mul_pd(_mm256_mul_pd(v, v), v);
+    __m256d u2 = _mm256_mul_pd(_mm256_set1_pd(-2 * 0.7978845608028654),
+                               _mm256_fmadd_pd(_mm256_set1_pd(0.044715), v3, v));
+    return _mm256_div_pd(v, _mm256_add_pd(_mm256_set1_pd(1.0), exp_pd(u2)));
+  }
+  return v;
+}
+
+struct ep_call {
+  const fiveloops_epilogue *ep;   // NULL for none
+  double *C;
+  int csC;
+  int stream;                     // store C with streaming stores; C's columns are all 64-byte aligned then
+};
+
+static __thread const struct ep_call *ep_panel;
+
+// C := act( Ct + betaC C + bias ) for an m x n tile of e->C (Ct column-major, leading dimension ldt). Ct may be C.
+// Always inlined with act constant, so that the activation doesn't get picked for every vector.
+// With stream set, the whole vectors go out with streaming stores (and c[i] has to be 32-byte aligned)
+static inline __attribute__((always_inline)) void ep_tile( int act, const double *bias_m, const double *bias_n,
+       int m, int n, const double *Ct, int ldt, double betaC, double *C, int csC, int stream )
+
+{
+  __m256d vb = _mm256_set1_pd(betaC);
+  __m256i mask = rows_mask(m % 4);
+
+  for (int j=0; j<n; j++) {
+    double *c = &C[ (long) j*csC ];
+    const double *t = &Ct[ (long) j*ldt ];
+    __m256d bn = _mm256_set1_pd(bias_n ? bias_n[j] : 0.0);
+
+    int i = 0;
+    for (; i+4<=m; i+=4) {
+      __m256d v = _mm256_add_pd(_mm256_loadu_pd(&t[i]), bn);
+      if (betaC != 0.0)
+        v = _mm256_fmadd_pd(vb, _mm256_loadu_pd(&c[i]), v);
+      if (bias_m)
+        v = _mm256_add_pd(v, _mm256_loadu_pd(&bias_m[i]));
+      if (stream)
+        _mm256_stream_pd(&c[i], activate(act, v));
+      else
+        _mm256_storeu_pd(&c[i], activate(act, v));
+    }
+    if (i < m) {
+      __m256d v = _mm256_add_pd(_mm256_maskload_pd(&t[i], mask), bn);
+      if (betaC != 0.0)
+        v = _mm256_fmadd_pd(vb, _mm256_maskload_pd(&c[i], mask), v);
+      if (bias_m)
+        v = _mm256_add_pd(v, _mm256_maskload_pd(&bias_m[i], mask));
+      _mm256_maskstore_pd(&c[i], mask, activate(act, v));
+    }
+  }
+}
+
+static void ep_store( const struct ep_call *e, int m, int n, const double *Ct, int ldt, double betaC, double *C )
+
+{
+  const fiveloops_epilogue *ep = e->ep;
+  long off = C - e->C;
+  int i0 = (int) (off % e->csC), j0 = (int) (off / e->csC);
+  const double *bias_m = ep && ep->bias_m ? ep->bias_m + i0 : NULL, *bias_n = ep && ep->bias_n ? ep->bias_n + j0 : NULL;
+  int csC = e->csC, stream = e->stream;
+
+  switch (ep ? ep->act : FIVELOOPS_ACT_NONE) {
+  case FIVELOOPS_ACT_RELU: ep_tile( FIVELOOPS_ACT_RELU, bias_m, bias_n, m, n, Ct, ldt, betaC, C, csC, stream ); break;
+  case FIVELOOPS_ACT_GELU: ep_tile( FIVELOOPS_ACT_GELU, bias_m, bias_n, m, n, Ct, ldt, betaC, C, csC, stream ); break;
+  default:                 ep_tile( FIVELOOPS_ACT_NONE, bias_m, bias_n, m, n, Ct, ldt, betaC, C, csC, stream );
+  }
+}
+
+// The epilogue as a pass of its own over C, for the calls that don't go through the five loops
+static void ep_apply( const fiveloops_epilogue *ep, int m, int n, double *C, int rsC, int csC )
+
+{
+  if (rsC == 1) {
+    struct ep_call e = { ep, C, csC, 0 };
+    ep_store( &e, m, n, C, csC, 0.0, C );
+    return;
+  }
+  for (int j=0; j<n; j++)
+    for (int i=0; i<m; i++) {
+      double v = gamma(i,j) + (ep->bias_m ? ep->bias_m[i] : 0.0) + (ep->bias_n ? ep->bias_n[j] : 0.0);
+      gamma(i,j) = _mm256_cvtsd_f64( activate(ep->act, _mm256_set1_pd(v)) );
+    }
+}
+
+// Points the context (and its node and group contexts) at e, or at nothing
+static void ctx_set_epilogue( fiveloops_ctx *ctx, const struct ep_call *e )
+
+{
+  ctx->ep = e;
+  for (int nd=0; nd<ctx->nnodes; nd++)
+    ctx_set_epilogue(ctx->nodes[nd], e);
+  for (int g=0; g<ctx->ngroups; g++)
+    ctx_set_epilogue(ctx->groups[g], e);
+}
+
+// Whether C should be streamed out, past the caches: only if it's never read (betaC 0, and one KC panel,
+// since every panel after the first adds onto C), if it's bigger than the last level cache, and if all its
+// columns start on a cache line, so that every MR rows of them (and so every tile) do too
+static int stream_C( fiveloops_ctx *ctx, int m, int n, int k, double betaC, double *C, int rsC, int csC )
+
+{
+  pthread_once(&host_blocking_once, host_blocking_init);
+  return betaC == 0.0 && k <= ctx->blk.kc && rsC == 1 && (size_t) m * n * sizeof(double) >= stream_min_bytes &&
+         (uintptr_t) C % 64 == 0 && (n == 1 || csC % 8 == 0) && ctx->blk.mr % 8 == 0;
+}
+
+// fiveloops_scaled for a C that should be streamed out, with the kernel's _nt variant (non-temporal stores of C;
+// nothing to do with fiveloops_streamed, which streams the operands in from files). Returns 0 (and does
+// nothing) if it shouldn't be, or there's no such kernel
+static int gemm_stream_C( fiveloops_ctx *ctx, int m, int n, int k, double alphaA, double *A, int rsA, int csA,
+       double *B, int rsB, int csB, double betaC, double *C, int rsC, int csC )
+
+{
+  if (!ctx->blk.ukernel_nt || !stream_C( ctx, m, n, k, betaC, C, rsC, csC ))
+    return 0;
+
+  struct ep_call e = { NULL, C, n == 1 ? m : csC, 1 };
+  ctx_set_epilogue( ctx, &e );
+  fiveloops_from( ctx, m, n, k, alphaA, A, rsA, csA, B, rsB, csB, NULL, betaC, C, rsC, csC );
+  ctx_set_epilogue( ctx, NULL );
+  return 1;
+}
+
+// C := act( alphaA AB + betaC C + bias ), see fiveloops_epilogue. Row-major C gets turned around like in
+// fiveloops_scaled. Anything else that isn't column-major, the tiny multiplications, and k == 0 don't go through
+// the loops (or the kernels), so they get the epilogue afterwards. Everything else goes straight to the five
+// loops, without Strassen, the accelerator or the paths for skinny shapes, none of which store C by the tile
+void fiveloops_scaled_epilogue( fiveloops_ctx *ctx, int m, int n, int k, double alphaA, double *A, int rsA, int csA,
+       double *B, int rsB, int csB, double betaC, double *C, int rsC, int csC, const fiveloops_epilogue *ep )
+
+{
+  if (m <= 0 || n <= 0)
+    return;
+
+  // No epilogue at all is a plain multiplication, with everything fiveloops_scaled can do for one
+  if (!ep) {
+    if (k <= 0 || alphaA == 0.0)
+      scale_C( m, n, betaC, C, rsC, csC );
+    else
+      fiveloops_scaled( ctx, m, n, k, alphaA, A, rsA, csA, B, rsB, csB, betaC, C, rsC, csC );
+    return;
+  }
+
+  if (csC == 1 && rsC != 1) {
+    fiveloops_epilogue t = { ep->bias_n, ep->bias_m, ep->act };
+    fiveloops_scaled_epilogue( ctx, n, m, k, alphaA, B, csB, rsB, A, csA, rsA, betaC, C, csC, rsC, &t );
+    return;
+  }
+
+  if (k <= 0 || alphaA == 0.0) {
+    scale_C( m, n, betaC, C, rsC, csC );
+    ep_apply( ep, m, n, C, rsC, csC );
+    return;
+  }
+  if (rsC != 1) {
+    fiveloops_scaled( ctx, m, n, k, alphaA, A, rsA, csA, B, rsB, csB, betaC, C, rsC, csC );
+    ep_apply( ep, m, n, C, rsC, csC );
+    return;
+  }
+  if (is_small( m, n, k ) && gemm_small( 1, m, n, k, alphaA, A, rsA, csA, B, rsB, csB, betaC, C, rsC, csC )) {
+    ep_apply( ep, m, n, C, rsC, csC );
+    return;
+  }
+
+  // With only the one column, the leading dimension can be anything; ep_store still has to tell rows from columns
+  if (n == 1 && csC < m)
+    csC = m;
+
+  struct ep_call e = { ep, C, csC, stream_C( ctx, m, n, k, betaC, C, rsC, csC ) };
+  ctx_set_epilogue( ctx, &e );
+  fiveloops_from( ctx, m, n, k, alphaA, A, rsA, csA, B, rsB, csB, NULL, betaC, C, rsC, csC );
+  ctx_set_epilogue( ctx, NULL );
+}
+
+// The same, column-major, like dgemm
+void dgemm_epilogue( char transA, char transB, int m, int n, int k, double alpha, double *A, int lda,
+       double *B, int ldb, double beta, double *C, int ldc, const fiveloops_epilogue *ep )
+
+{
+  int rsA, csA, rsB, csB;
+  op_strides( transA, lda, &rsA, &csA );
+  op_strides( transB, ldb, &rsB, &csB );
+  fiveloops_scaled_epilogue( default_ctx(), m, n, k, alpha, A, rsA, csA, B, rsB, csB, beta, C, 1, ldc, ep );
+}
+
+static void threeloops_steal( fiveloops_ctx *ctx, int m, int n, int k, double alphaA, double *A, int rsA, int csA,
+       double *Bt, double betaC, double *C, int rsC, int csC );
+
+// With Bp set, B has been packed already (see fiveloops_pack_B): Bp is this NC block of it,
+// made up of the k/KC panels one after the other, so there is nothing left to pack
+static void fourloops_from( fiveloops_ctx *ctx, int m, int n, int k, double alphaA, double *A, int rsA, int csA,
+       double *B, int rsB, int csB, const double *Bp, double betaC, double *C, int rsC, int csC )
+
+{
+  int mc = ctx->blk.mc, kc = ctx->blk.kc, nr = ctx->blk.nr;
+
+  // Splitting the third loop is the better deal (every thread packs and reuses its own At), but only if
+  // there are at least as many MC blocks as threads. Otherwise the threads share one At and split the second loop
+  int nthreads = ctx->nthreads;
+  int split_ic = (m + mc - 1) / mc >= nthreads;
+
+  #pragma omp parallel num_threads(nthreads)
+  {
+    double *At = split_ic ? ctx->At + omp_get_thread_num() * ctx->At_stride : ctx->At;
+    STATS_START( t4 );
+
+    if (ctx->node >= 0)
+      pin_to_node(ctx->node);
+
+    for (int p=0; p<k; p+=kc) {
+      int pb = min(kc, k-p);
+
+      // The context's buffers are 2MB (and so 64-byte) aligned, which allows quicker CPU access in the kernel
+      double *Bt = ctx->Bt;
+
+      if (Bp) {
+        Bt = (double *) Bp + p * round_up(n, nr);
+      } else {
+        // All threads pack Bt together (see packB_KCxNC), and nobody leaves it before the whole panel is done
+        STATS_START( tB );
+        packB_KCxNC( nr, pb, n, &beta(p,0), rsB, csB, Bt);
+        STATS_STOP( ctx, cycles_pack_B, tB );
+        if (omp_get_thread_num() == 0) {
+          STATS_ADD( ctx, bytes_packed_B, (unsigned long long) pb * round_up(n, nr) * sizeof(double) );
+        }
+      }
+
+      // beta only applies the first time C is updated; after that we're adding onto the partial result.
+      // The epilogue, if there is one, comes with the last
+      ep_panel = p + pb >= k ? ctx->ep : NULL;
+      if (ctx->use_steal)
+        threeloops_steal( ctx, m, n, pb, alphaA, &alpha(0,p), rsA, csA, Bt, p == 0 ? betaC : 1.0, C, rsC, csC );
+      else
+        threeloops( ctx, m, n, pb, alphaA, &alpha(0,p), rsA, csA, Bt, At, split_ic, p == 0 ? betaC : 1.0,
+                    C, rsC, csC );
+    }
+    ep_panel = NULL;
+
+    // Streaming stores aren't ordered with anything else: they have to be done before the caller reads C
+    if (ctx->ep && ctx->ep->stream)
+      _mm_sfence();
+
+    STATS_STOP( ctx, cycles_loop4, t4 );
+  }
+}
+
+// Turns the four rows r0..r3 of a 4x4 block into its four columns
+static inline void transpose_4x4( __m256d *r0, __m256d *r1, __m256d *r2, __m256d *r3 )
+
+{
+  __m256d t0 = _mm256_unpacklo_pd(*r0, *r1);  // r0[0] r1[0] r0[2] r1[2]
+  __m256d t1 = _mm256_unpackhi_pd(*r0, *r1);  // r0[1] r1[1] r0[3] r1[3]
+  __m256d t2 = _mm256_unpacklo_pd(*r2, *r3);
+  __m256d t3 = _mm256_unpackhi_pd(*r2, *r3);
+  *r0 = _mm256_permute2f128_pd(t0, t2, 0x20);   // r0[0] r1[0] r2[0] r3[0]
+  *r1 = _mm256_permute2f128_pd(t1, t3, 0x20);
+  *r2 = _mm256_permute2f128_pd(t0, t2, 0x31);
+  *r3 = _mm256_permute2f128_pd(t1, t3, 0x31);
+}
+
+// Both packers come down to the same thing: copy the k x w matrix X(p,c) = X[ p*rsX + c*csX ] (times s)
+// into P row by row, each row padded out to ldp doubles with zeros.
+// When X's rows are contiguous (csX == 1) that's a straight vector copy. When its columns are (rsX == 1, which is
+// column-major B, row-major A, or anything that was transposed) we read 4x4 blocks down the columns and
+// transpose them in registers, instead of a strided scalar load for every element. That goes four columns
+// at a time all the way down, rather than across the sliver, so that only four streams are being read at once.
+// The source is only read this once, so it's prefetched non-temporally (PACK_PREFETCH rows/columns ahead)
+// to keep it from pushing At and Bt out
+#ifndef PACK_PREFETCH
+#define PACK_PREFETCH 8
+#endif
+
+static inline __attribute__((always_inline)) void copy_rows( int w, int ldp, int k, double s, const double *X, int rsX,
+       double *P )
+
+{
+  __m256d vs = _mm256_set1_pd(s);
+
+  for (int p=0; p<k; p++) {
+    const double *x = &X[ p*rsX ];
+    double *row = &P[ p*ldp ];
+    _mm_prefetch((const char *) (x + PACK_PREFETCH*rsX), _MM_HINT_NTA);
+    int c = 0;
+    for (; c+4<=w; c+=4)
+      _mm256_storeu_pd(&row[c], _mm256_mul_pd(vs, _mm256_loadu_pd(&x[c])));
+    for (; c<w; c++)
+      row[c] = s * x[c];
+  }
+}
+
+static void pack_sliver( int ldp, int w, int k, double s, const double *X, int rsX, int csX, double *P )
+
+{
+  __m256d vs = _mm256_set1_pd(s);
+  int p = 0;
+
+  if (csX == 1) {
+    // w is almost always the kernel's mr or nr, and with a constant w each row is a handful of straight
+    // loads and stores. Everything else goes through the same loop with w as it is
+    switch (w) {
+    case 8:  copy_rows( 8, ldp, k, s, X, rsX, P ); break;
+    case 24: copy_rows( 24, ldp, k, s, X, rsX, P ); break;
+    default: copy_rows( w, ldp, k, s, X, rsX, P );
+    }
+    p = k;
+  } else if (rsX == 1) {
+    int k4 = k / 4 * 4, c = 0;
+    for (; c+4<=w; c+=4)
+      for (p=0; p<k4; p+=4) {
+        const double *x = &X[ p + c*csX ];
+        __m256d r0 = _mm256_loadu_pd(x), r1 = _mm256_loadu_pd(x + csX),
+                r2 = _mm256_loadu_pd(x + 2*csX), r3 = _mm256_loadu_pd(x + 3*csX);
+        transpose_4x4(&r0, &r1, &r2, &r3);
+        _mm256_storeu_pd(&P[ (p+0)*ldp + c ], _mm256_mul_pd(vs, r0));
+        _mm256_storeu_pd(&P[ (p+1)*ldp + c ], _mm256_mul_pd(vs, r1));
+        _mm256_storeu_pd(&P[ (p+2)*ldp + c ], _mm256_mul_pd(vs, r2));
+        _mm256_storeu_pd(&P[ (p+3)*ldp + c ], _mm256_mul_pd(vs, r3));
+      }
+    for (; c<w; c++)
+      for (p=0; p<k4; p++)
+        P[ p*ldp + c ] = s * X[ p + c*csX ];
+    p = k4;
+  }
+
+  // any layout, plus the last few rows of the transposed one
+  for (; p<k; p++)
+    for (int c=0; c<w; c++)
+      P[ p*ldp + c ] = s * X[ p*rsX + c*csX ];
+
+  if (w < ldp)
+    for (p=0; p<k; p++)
+      for (int c=w; c<ldp; c++)
+        P[ p*ldp + c ] = 0.0;
+}
+
+// The following two functions "pack" the submatrix Bt so that it can be accessed contiguously in memory
+// for increased access speed later
+// A diagram of this process can be seen at https://www.cs.utexas.edu/~flame/laff/pfhp/images/Week3/BLISPicturePack.png
+//
+// When called from inside fourloops' parallel region the NR panels are shared out between the threads,
+// each thread packing whole panels straight into their place in Bt. The implicit barrier at the end
+// of the loop is what makes it safe for threeloops to start reading Bt afterwards
+void packB_KCxNC( int nr, int k, int n, double *B, int rsB, int csB, double *Bt )
+
+{
+  #pragma omp for schedule(static)
+  for ( int j=0; j<n; j+= nr ){
+    int jb = min( nr, n-j );
+    // every panel before this one is a full k x nr, so this one starts at j*k
+    packB_KCxNR( nr, k, jb, &beta( 0, j ), rsB, csB, &Bt[ j*k ] );
+  }
+}
+
+void packB_KCxNR( int nr, int k, int n, double *B, int rsB, int csB, double *Bt )
+
+{
+  // row p of the panel is B(p, 0..n-1), padded out to nr with zeros
+  pack_sliver( nr, n, k, 1.0, B, rsB, csB, Bt );
+}
+
+// third loop - Bt is passed in completely, C is split up into MC row-length chunks, A is buffered into At
+// This runs inside the parallel region opened by fourloops, so the worksharing loops below are split
+// across that region's threads
+void threeloops( fiveloops_ctx *ctx, int m, int n, int k, double alphaA, double *A, int rsA, int csA,
+       double *Bt, double *At, int split_ic, double betaC, double *C, int rsC, int csC )
+
+{
+  int mr = ctx->blk.mr, mc = ctx->blk.mc;
+  STATS_START( t3 );
+
+  if (split_ic) {
+    // Every thread takes whole MC blocks, packs each into its own At and runs the inner loops alone.
+    // Dynamic scheduling so that the (smaller) last block doesn't hold everyone up
+    #pragma omp for schedule(dynamic)
+    for (int i=0; i<m; i+=mc) {
+      int ib = min(mc, m-i);
+
+      twoloops_packA( ctx, ib, n, k, alphaA, &alpha(i,0), rsA, csA, At, Bt, betaC, &gamma(i,0), rsC, csC );
+    }
+  } else {
+    for (int i=0; i<m; i+=mc) {
+      int ib = min(mc, m-i);
+
+      // At is shared here, so the threads pack it together one MR sliver at a time
+      // (the implicit barrier at the end of the loop means nobody starts computing with a half-packed At)
+      STATS_START( tA );
+      #pragma omp for schedule(static)
+      for (int ii=0; ii<ib; ii+=mr) {
+        packA_MRxKC( mr, min(mr, ib-ii), k, alphaA, &alpha(i+ii,0), rsA, csA, &At[ii*k] );
+        STATS_ADD( ctx, bytes_packed_A, (unsigned long long) mr * k * sizeof(double) );
+      }
+      STATS_STOP( ctx, cycles_pack_A, tA );
+
+      twoloops( ctx, ib, n, k, At, Bt, 1, betaC, &gamma(i,0), rsC, csC );
+    }
+  }
+
+  STATS_STOP( ctx, cycles_loop3, t3 );
+}
+
+// The third loop again, but with the MC blocks and the second loop's NR panels handed out by work stealing
+// (the default with more than one thread). The static splits above go wrong whenever the threads don't
+// finish together: the last, short MC or NC block leaves most of them waiting, and so does a thread that
+// the OS has put aside to run something else.
+// Here the threads take MC blocks off a shared counter and pack each into their own At, as in the split_ic case.
+// Then they work through the block in chunks of NR panels, taken off a counter in their steal_slot, and
+// anyone who runs out of blocks takes chunks from the other threads' slots (reading the owner's At) until
+// there are none left anywhere. The jr-split case needs no special handling: with fewer blocks than threads
+// the threads with no block of their own just start stealing straight away.
+// Before packing its next block an owner closes its slot and waits for the thieves still inside to leave,
+// so nobody ever reads a half-packed At
+#define STEAL_CLOSED (INT_MAX / 2)
+
+// Works through the chunks in s (with At, the owner's At) until there are none left; 0 if there weren't any
+static int steal_chunks( fiveloops_ctx *ctx, struct steal_slot *s, double *At, int chunks, int chunk,
+       int n, int k, double *Bt, double betaC, double *C, int rsC, int csC )
+
+{
+  int nr = ctx->blk.nr, did = 0;
+
+  for (;;) {
+    int c = __atomic_fetch_add(&s->next, 1, __ATOMIC_SEQ_CST);
+    if (c >= chunks)
+      return did;
+
+    int j = c * chunk * nr;
+    twoloops( ctx, s->ib, min(chunk * nr, n-j), k, At, &Bt[j*k], 0, betaC, &gamma(s->i, j), rsC, csC );
+    did = 1;
+  }
+}
+
+static void threeloops_steal( fiveloops_ctx *ctx, int m, int n, int k, double alphaA, double *A, int rsA, int csA,
+       double *Bt, double betaC, double *C, int rsC, int csC )
+
+{
+  int mr = ctx->blk.mr, mc = ctx->blk.mc, nr = ctx->blk.nr;
+  int tid = omp_get_thread_num(), nt = omp_get_num_threads();
+  struct steal_slot *mine = &ctx->steal[tid];
+  double *At = ctx->At + tid * ctx->At_stride;
+  STATS_START( t3 );
+
+  // About two chunks per thread for each block, so there's something left to steal at the end
+  int panels = (n + nr - 1) / nr;
+  int chunk = (panels + 2*nt - 1) / (2*nt);
+  int chunks = (panels + chunk - 1) / chunk;
+
+  // (everyone is done with the previous KC panel by now, so the counter can start over)
+  if (tid == 0)
+    ctx->steal_next_i = 0;
+  #pragma omp barrier
+
+  for (;;) {
+    __atomic_store_n(&mine->packing, 1, __ATOMIC_SEQ_CST);
+    int i = __atomic_fetch_add(&ctx->steal_next_i, mc, __ATOMIC_SEQ_CST);
+    if (i >= m)
+      break;
+    int ib = min(mc, m-i);
+
+    __atomic_store_n(&mine->next, STEAL_CLOSED, __ATOMIC_SEQ_CST);
+    while (__atomic_load_n(&mine->busy, __ATOMIC_SEQ_CST))
+      sched_yield();
+
+    STATS_START( tA );
+    packA_MCxKC( mr, ib, k, alphaA, &alpha(i,0), rsA, csA, At );
+    STATS_STOP( ctx, cycles_pack_A, tA );
+    STATS_ADD( ctx, bytes_packed_A, (unsigned long long) round_up(ib, mr) * k * sizeof(double) );
+
+    mine->i = i;
+    mine->ib = ib;
+    __atomic_store_n(&mine->next, 0, __ATOMIC_SEQ_CST);
+    __atomic_store_n(&mine->packing, 0, __ATOMIC_SEQ_CST);
+
+    steal_chunks( ctx, mine, At, chunks, chunk, n, k, Bt, betaC, C, rsC, csC );
+  }
+  __atomic_store_n(&mine->next, STEAL_CLOSED, __ATOMIC_SEQ_CST);
+  __atomic_store_n(&mine->packing, 0, __ATOMIC_SEQ_CST);
+
+  // Out of blocks: help the others with theirs, for as long as anyone has chunks left (or is about to).
+  // Waiting for someone to finish packing, we give up the CPU: on a busy machine it may be the one they need
+  for (int more = 1; more; ) {
+    int stole = 0, waiting = 0;
+    for (int v=1; v<nt; v++) {
+      int owner = (tid + v) % nt;
+      struct steal_slot *s = &ctx->steal[owner];
+
+      waiting |= __atomic_load_n(&s->packing, __ATOMIC_SEQ_CST);
+      __atomic_add_fetch(&s->busy, 1, __ATOMIC_SEQ_CST);
+      stole |= steal_chunks( ctx, s, ctx->At + owner * ctx->At_stride, chunks, chunk, n, k, Bt, betaC,
+                             C, rsC, csC );
+      __atomic_sub_fetch(&s->busy, 1, __ATOMIC_SEQ_CST);
+    }
+    if (waiting && !stole)
+      sched_yield();
+    more = waiting || stole;
+  }
+
+  // and nobody packs the next Bt before the last chunk of this one is done
+  #pragma omp barrier
+  STATS_STOP( ctx, cycles_loop3, t3 );
+}
+
+// The same packing process is done with matrix A 
+// (including padding for matrices with sizes that are not multiples of MR)
+// This is also where the alpha of C := alpha AB + beta C gets applied: every element of A goes through
+// here once per KC block anyway, which is far fewer multiplies than scaling AB in the kernel
+void packA_MCxKC( int mr, int m, int k, double alphaA, double *A, int rsA, int csA, double *At )
+
+{
+  for ( int i=0; i<m; i+=mr ) {
+    int ib = min(mr, m-i);
+    packA_MRxKC( mr, ib, k, alphaA, &alpha(i,0), rsA, csA, At);
+    At += ib * k;
+  }
+}
+
+
+void packA_MRxKC( int mr, int m, int k, double alphaA, double *A, int rsA, int csA, double *At )
+
+{
+  // "row" p of the sliver is column p of A, so the strides swap places
+  pack_sliver( mr, m, k, alphaA, A, csA, rsA, At );
+}
+
+// A whole MC x KC block of A for a single thread: packs it into At and runs the second loop over it.
+// With FIVELOOPS_FUSED_PACK (the default) the packing is folded into the first NR sweep instead:
+// each MR sliver gets packed right before the kernel uses it with the first panel of Bt, while it is
+// still in L1, so At isn't written out to L2 in one go and then read back in. The other panels then
+// reuse the packed At as usual. That mostly helps when n is small (a handful of NR panels), where
+// packing A is a good part of the work
+#ifndef FIVELOOPS_FUSED_PACK
+#define FIVELOOPS_FUSED_PACK 1
+#endif
+
+static void twoloops_packA( fiveloops_ctx *ctx, int m, int n, int k, double alphaA, double *A, int rsA, int csA,
+       double *At, double *Bt, double betaC, double *C, int rsC, int csC )
+
+{
+  int mr = ctx->blk.mr, nr = ctx->blk.nr;
+  STATS_ADD( ctx, bytes_packed_A, (unsigned long long) round_up(m, mr) * k * sizeof(double) );
+
+  if (!FIVELOOPS_FUSED_PACK) {
+    STATS_START( tA );
+    packA_MCxKC( mr, m, k, alphaA, A, rsA, csA, At );
+    STATS_STOP( ctx, cycles_pack_A, tA );
+
+    twoloops( ctx, m, n, k, At, Bt, 0, betaC, C, rsC, csC );
+    return;
+  }
+
+  int jb = min(nr, n);
+  STATS_START( t2 );
+
+  for (int i=0; i<m; i+=mr) {
+    int ib = min(mr, m-i);
+
+    STATS_START( tA );
+    packA_MRxKC( mr, ib, k, alphaA, &alpha(i,0), rsA, csA, &At[i*k] );
+    STATS_STOP( ctx, cycles_pack_A, tA );
+
+    oneloop( ctx, ib, jb, k, &At[i*k], Bt, betaC, &gamma(i,0), rsC, csC );
+  }
+
+  STATS_STOP( ctx, cycles_loop2, t2 );
+
+  if (n > nr)
+    twoloops( ctx, m, n-nr, k, At, &Bt[nr*k], 0, betaC, &gamma(0,nr), rsC, csC );
+}
+
+// second loop - At is passed in completely, C and Bt are split up into NR column-wide chunks
+// With split_jr set the NR chunks are shared out between the threads of the enclosing parallel region
+void twoloops( fiveloops_ctx *ctx, int m, int n, int k, double *At, double *Bt, int split_jr,
+       double betaC, double *C, int rsC, int csC )
+
+{
+  int nr = ctx->blk.nr;
+  STATS_START( t2 );
+
+  if (split_jr) {
+    #pragma omp for schedule(static)
+    for (int j=0; j<n; j+=nr) {
+      int jb = min(nr, n-j);
+
+      oneloop( ctx, m, jb, k, At, &Bt[j*k], betaC, &gamma(0,j), rsC, csC );
+    }
+  } else {
+    for (int j=0; j<n; j+=nr) {
+      int jb = min(nr, n-j);
+
+      oneloop( ctx, m, jb, k, At, &Bt[j*k], betaC, &gamma(0,j), rsC, csC );
+    }
+  }
+
+  STATS_STOP( ctx, cycles_loop2, t2 );
+}
+
+// The kernels always load and store a full MR x NR tile of C, with unit row stride.
+// For the tiles along the bottom and right edges of C (and for any C that isn't stored with unit row stride)
+// we run the kernel on a small column-major buffer instead, and copy back only the m x n part that is really in C.
+// At and Bt are padded with zeros, so whatever the kernel computes for the rest of the buffer is never used
+static void ukernel_fringe( const fiveloops_blocking *b, int m, int n, int k, double *mpA, double *mpB,
+       double betaC, double *C, int rsC, int csC )
+
+{
+  double Ct[ MAX_TILE ] __attribute__((aligned(64)));
+  int mr = b->mr, nr = b->nr;
+
+  memset(Ct, 0, sizeof(double) * mr * nr);
+  if (betaC != 0.0)
+    for (int j=0; j<n; j++)
+      for (int i=0; i<m; i++)
+        Ct[ i + j*mr ] = gamma(i,j);
+
+  b->ukernel(k, mpA, mpB, betaC, Ct, 1, mr);
+
+  for (int j=0; j<n; j++)
+    for (int i=0; i<m; i++)
+      gamma(i,j) = Ct[ i + j*mr ];
+}
+
+// first loop - Bt is passed in completely, At and C are split up into MR row-length chunks
+void oneloop( fiveloops_ctx *ctx, int m, int n, int k, double *At, double *Bt, double betaC,
+       double *C, int rsC, int csC )
+
+{
+  int mr = ctx->blk.mr;
+  int full_cols = n == ctx->blk.nr && rsC == 1;
+  STATS_START( t1 );
+
+  for (int i=0; i<m; i+=mr) {
+    int ib = min(mr, m-i);
+
+    if (ep_panel && !ep_panel->ep && full_cols && ib == mr) {
+      ctx->blk.ukernel_nt(k, &At[i*k], Bt, betaC, &gamma(i,0), rsC, csC );
+      STATS_ADD( ctx, kernel_calls, 1 );
+    } else if (ep_panel) {
+      // The kernel doesn't see C, so it can't prefetch it either; ask for the tile now, while the kernel runs.
+      // Unless it's being streamed out, when the point is to never have it in cache
+      double Ct[ MAX_TILE ] __attribute__((aligned(64)));
+      for (int j=0; j<n && !ep_panel->stream; j++)
+        for (int ii=0; ii<ib; ii+=8)
+          _mm_prefetch((const char *) &gamma(i+ii,j), _MM_HINT_T0);
+      ctx->blk.ukernel(k, &At[i*k], Bt, 0.0, Ct, 1, mr);
+      ep_store( ep_panel, ib, n, Ct, mr, betaC, &gamma(i,0) );
+      STATS_ADD( ctx, kernel_calls, 1 );
+    } else if (full_cols && ib == mr) {
+      ctx->blk.ukernel(k, &At[i*k], Bt, betaC, &gamma(i,0), rsC, csC );
+      STATS_ADD( ctx, kernel_calls, 1 );
+    } else {
+      ukernel_fringe( &ctx->blk, ib, n, k, &At[i*k], Bt, betaC, &gamma(i,0), rsC, csC );
+      STATS_ADD( ctx, fringe_calls, 1 );
+    }
+  }
+
+  STATS_STOP( ctx, cycles_loop1, t1 );
+}
+
+
+// The kernels pick up C through these, once the p loop is done: acc + betaC * c, which costs one FMA per
+// register and nothing at all when betaC is zero. Then C is never read, which is also what BLAS promises
+// (C may hold NaNs on input). Every kernel adds C on last, after summing its k products from zero in order,
+// so that they all round the same way and reproducible mode doesn't depend on the kernel
+// (see fiveloops_set_reproducible)
+static inline __m256d add_scaled( __m256d acc, double *c, double betaC )
+
+{
+  if (betaC == 0.0)
+    return acc;
+  return _mm256_fmadd_pd( _mm256_set1_pd( betaC ), _mm256_loadu_pd( c ), acc );
+}
+
+__attribute__((target("avx512f")))
+static inline __m512d add_scaled_512( __m512d acc, double *c, double betaC )
+
+{
+  if (betaC == 0.0)
+    return acc;
+  return _mm512_fmadd_pd( _mm512_set1_pd( betaC ), _mm512_loadu_pd( c ), acc );
+}
 
-/*
- * Matrix multiplication requires all three matrices to have certain dimensions.
- * For the operation C = AB + C, where A B and C are all matrices:
- * Let A be an m x n matrix, B must be an n x k matrix, C must be an m x k matrix
- *
-    @param m              the column-length of matrices A and C
-    @param n              the row-length of matrix A, the column-length of matrix B
-    @param k              the row-length of matrices B and C
+ void dgemm_ukernel_packed(int k, double *mpA, double *mpB, double betaC, double *C, int rsC, int csC) 
+ 
+ {
+    // Finally, in the kernel, we have a guarantee that all matrices can be stored in the GPRs
 
-    @params A, B, C       pointers to the matrices A, B and C
-    @params rsA, rsB, rsC the "row stride" of matrices A, B and C
-    @params csA, csB, csC the "column stride" of matrices A, B and C
+    // We allocate 4 registers for matrix C, and one for mpA and mpB (our slices of A and B) respectively
+    __m256d gamma_0123_0, gamma_0123_1, gamma_0123_2, gamma_0123_3;
+    __m256d alpha_0123_p, beta_p_j;
+
+    // The registers start from zero; C (times beta) only gets added on at the end
+    gamma_0123_0 = gamma_0123_1 = gamma_0123_2 = gamma_0123_3 = _mm256_setzero_pd();
+
+
+    for ( int p=0; p < k; p++){
+
+      // aligned load is used ('load' instead of 'loadu'), since A and B are packed, for faster access
+      alpha_0123_p = _mm256_load_pd( mpA ) ;
+      beta_p_j     = _mm256_broadcast_sd( mpB );
+      // loads values into the registers holding values for A and B
+      gamma_0123_0 = _mm256_fmadd_pd( alpha_0123_p, beta_p_j, gamma_0123_0 );
+      // 'fmadd' is a batch multiply-add operation for packed vectors: gamma = alpha * beta + gamma
+
+      beta_p_j     = _mm256_broadcast_sd( mpB+1 );
+      gamma_0123_1 = _mm256_fmadd_pd( alpha_0123_p, beta_p_j, gamma_0123_1 );
+
+      beta_p_j     = _mm256_broadcast_sd( mpB+2 );
+      gamma_0123_2 = _mm256_fmadd_pd( alpha_0123_p, beta_p_j, gamma_0123_2 );
+
+      beta_p_j     = _mm256_broadcast_sd( mpB+3 );
+      gamma_0123_3 = _mm256_fmadd_pd( alpha_0123_p, beta_p_j, gamma_0123_3 );
+      mpA += 4;
+      mpB += 4;
+  }
+
+  // stores the partial result to memory
+  // This is what makes the math work out even when subdividing the matrices like this
+  // C now contains a "partial result" that is reused for later microkernel runs
+  _mm256_storeu_pd( &gamma(0,0), add_scaled( gamma_0123_0, &gamma(0,0), betaC ) );
+  _mm256_storeu_pd( &gamma(0,1), add_scaled( gamma_0123_1, &gamma(0,1), betaC ) );
+  _mm256_storeu_pd( &gamma(0,2), add_scaled( gamma_0123_2, &gamma(0,2), betaC ) );
+  _mm256_storeu_pd( &gamma(0,3), add_scaled( gamma_0123_3, &gamma(0,3), betaC ) );
+ }
 
-    Row stride is the number of bytes in memory between separate columns of a matrix
-    Column stride is the number of bytes in memory between separate rows of a matrix
-*/
-void fiveloops( int m, int n, int k, double *A, int rsA, int csA, 
-	     double *B, int rsB, int csB,  double *C, int rsC, int csC )
+
+// The 4x4 kernel only has one FMA chain per accumulator and four accumulators in all, while an FMA takes
+// about 4 cycles and two can start every cycle, so it can keep at most half of the FMA units busy.
+// This one keeps an 8x6 tile of C in 12 registers (two per column: rows 0-3 and 4-7), which together
+// with the two registers for A and one for the broadcast of B uses 15 of the 16 ymm registers
+void dgemm_ukernel_packed_8x6( int k, double *mpA, double *mpB, double betaC, double *C, int rsC, int csC )
 
 {
-  // fifth loop - A is passed in completely, B and C are split up into NC column-wide chunks
-  for (int j=0; j<n; j+=NC) {
+  __m256d gamma_0123_0, gamma_0123_1, gamma_0123_2, gamma_0123_3, gamma_0123_4, gamma_0123_5;
+  __m256d gamma_4567_0, gamma_4567_1, gamma_4567_2, gamma_4567_3, gamma_4567_4, gamma_4567_5;
+  __m256d alpha_0123_p, alpha_4567_p, beta_p_j;
 
-    // This line allows for arbitrary-size matrices to be passed through, since NC is only an upper bound
-    int jb = min(NC, n-j);
+  gamma_0123_0 = gamma_0123_1 = gamma_0123_2 = gamma_0123_3 = gamma_0123_4 = gamma_0123_5 = _mm256_setzero_pd();
+  gamma_4567_0 = gamma_4567_1 = gamma_4567_2 = gamma_4567_3 = gamma_4567_4 = gamma_4567_5 = _mm256_setzero_pd();
 
-    // We were provided macros for matrix element access, eg
-    // #define alpha( i,j ) A[ (i)*rsA + (j)*csA ]
-    // So as to not clutter our code with references to matrix striding / pointer arithmetic
-    fourloops( m, jb, k, A, rsA, csA, &beta(0,j), rsB, csB, &gamma(0,j), rsC, csC );
+  for ( int p=0; p < k; p++ ) {
+    alpha_0123_p = _mm256_load_pd( mpA );
+    alpha_4567_p = _mm256_load_pd( mpA+4 );
+
+    beta_p_j     = _mm256_broadcast_sd( mpB );
+    gamma_0123_0 = _mm256_fmadd_pd( alpha_0123_p, beta_p_j, gamma_0123_0 );
+    gamma_4567_0 = _mm256_fmadd_pd( alpha_4567_p, beta_p_j, gamma_4567_0 );
+
+    beta_p_j     = _mm256_broadcast_sd( mpB+1 );
+    gamma_0123_1 = _mm256_fmadd_pd( alpha_0123_p, beta_p_j, gamma_0123_1 );
+    gamma_4567_1 = _mm256_fmadd_pd( alpha_4567_p, beta_p_j, gamma_4567_1 );
+
+    beta_p_j     = _mm256_broadcast_sd( mpB+2 );
+    gamma_0123_2 = _mm256_fmadd_pd( alpha_0123_p, beta_p_j, gamma_0123_2 );
+    gamma_4567_2 = _mm256_fmadd_pd( alpha_4567_p, beta_p_j, gamma_4567_2 );
+
+    beta_p_j     = _mm256_broadcast_sd( mpB+3 );
+    gamma_0123_3 = _mm256_fmadd_pd( alpha_0123_p, beta_p_j, gamma_0123_3 );
+    gamma_4567_3 = _mm256_fmadd_pd( alpha_4567_p, beta_p_j, gamma_4567_3 );
+
+    beta_p_j     = _mm256_broadcast_sd( mpB+4 );
+    gamma_0123_4 = _mm256_fmadd_pd( alpha_0123_p, beta_p_j, gamma_0123_4 );
+    gamma_4567_4 = _mm256_fmadd_pd( alpha_4567_p, beta_p_j, gamma_4567_4 );
+
+    beta_p_j     = _mm256_broadcast_sd( mpB+5 );
+    gamma_0123_5 = _mm256_fmadd_pd( alpha_0123_p, beta_p_j, gamma_0123_5 );
+    gamma_4567_5 = _mm256_fmadd_pd( alpha_4567_p, beta_p_j, gamma_4567_5 );
+
+    mpA += 8;
+    mpB += 6;
   }
+
+  _mm256_storeu_pd( &gamma(0,0), add_scaled( gamma_0123_0, &gamma(0,0), betaC ) );
+  _mm256_storeu_pd( &gamma(4,0), add_scaled( gamma_4567_0, &gamma(4,0), betaC ) );
+  _mm256_storeu_pd( &gamma(0,1), add_scaled( gamma_0123_1, &gamma(0,1), betaC ) );
+  _mm256_storeu_pd( &gamma(4,1), add_scaled( gamma_4567_1, &gamma(4,1), betaC ) );
+  _mm256_storeu_pd( &gamma(0,2), add_scaled( gamma_0123_2, &gamma(0,2), betaC ) );
+  _mm256_storeu_pd( &gamma(4,2), add_scaled( gamma_4567_2, &gamma(4,2), betaC ) );
+  _mm256_storeu_pd( &gamma(0,3), add_scaled( gamma_0123_3, &gamma(0,3), betaC ) );
+  _mm256_storeu_pd( &gamma(4,3), add_scaled( gamma_4567_3, &gamma(4,3), betaC ) );
+  _mm256_storeu_pd( &gamma(0,4), add_scaled( gamma_0123_4, &gamma(0,4), betaC ) );
+  _mm256_storeu_pd( &gamma(4,4), add_scaled( gamma_4567_4, &gamma(4,4), betaC ) );
+  _mm256_storeu_pd( &gamma(0,5), add_scaled( gamma_0123_5, &gamma(0,5), betaC ) );
+  _mm256_storeu_pd( &gamma(4,5), add_scaled( gamma_4567_5, &gamma(4,5), betaC ) );
 }
 
-// fourth loop - C is passed in completely, A is split up into KC column-wide chunks,
-// B is buffered into Bt (temporarily)
-void fourloops( int m, int n, int k, double *A, int rsA, int csA,
-       double *B, int rsB, int csB,  double *C, int rsC, int csC )
+// With AVX-512 there are 32 registers of 8 doubles each. A 24x8 tile of C takes 24 of them (three per column),
+// plus three for the column of A and one for the broadcast of B.
+// Spelling out 24 accumulators by name gets unreadable, so they're an array instead: every index is a
+// compile-time constant once the loops are unrolled, so the compiler keeps them all in registers.
+// The target attribute lets this live in the same binary as the AVX2 kernels; it only runs if the dispatcher
+// found AVX-512 on the host
+__attribute__((target("avx512f")))
+void dgemm_ukernel_packed_24x8( int k, double *mpA, double *mpB, double betaC, double *C, int rsC, int csC )
 
 {
-  // Aligned malloc, coupled with aligned free later, allows quicker CPU access in the kernel
-  // There is of course an accompanying slight loss in space efficiency
-  // '_mm_malloc' aligns with an 64-byte boundary in memory
-  double *Bt = (double *) _mm_malloc(KC*NC*sizeof(double), (size_t) 64);
+  __m512d gamma_j[8][3], alpha_p[3], beta_p_j;
 
-  for (int p=0; p<k; p+=KC) {
-    int pb = min(KC, k-p);
+  #pragma GCC unroll 8
+  for (int j=0; j<8; j++)
+    gamma_j[j][0] = gamma_j[j][1] = gamma_j[j][2] = _mm512_setzero_pd();
 
-    packB_KCxNC( pb, n, &beta(p,0), rsB, csB, Bt);
+  for ( int p=0; p < k; p++ ) {
+    alpha_p[0] = _mm512_load_pd( mpA );
+    alpha_p[1] = _mm512_load_pd( mpA+8 );
+    alpha_p[2] = _mm512_load_pd( mpA+16 );
+
+    #pragma GCC unroll 8
+    for (int j=0; j<8; j++) {
+      beta_p_j      = _mm512_set1_pd( mpB[j] );
+      gamma_j[j][0] = _mm512_fmadd_pd( alpha_p[0], beta_p_j, gamma_j[j][0] );
+      gamma_j[j][1] = _mm512_fmadd_pd( alpha_p[1], beta_p_j, gamma_j[j][1] );
+      gamma_j[j][2] = _mm512_fmadd_pd( alpha_p[2], beta_p_j, gamma_j[j][2] );
+    }
 
-    threeloops( m, n, pb, &alpha(0,p), rsA, csA, Bt, C, rsC, csC );
+    mpA += 24;
+    mpB += 8;
   }
 
-  _mm_free(Bt);
+  #pragma GCC unroll 8
+  for (int j=0; j<8; j++) {
+    _mm512_storeu_pd( &gamma(0, j),  add_scaled_512( gamma_j[j][0], &gamma(0, j), betaC ) );
+    _mm512_storeu_pd( &gamma(8, j),  add_scaled_512( gamma_j[j][1], &gamma(8, j), betaC ) );
+    _mm512_storeu_pd( &gamma(16, j), add_scaled_512( gamma_j[j][2], &gamma(16, j), betaC ) );
+  }
 }
 
-// The following two functions "pack" the submatrix Bt so that it can be accessed contiguously in memory
-// for increased access speed later
-// A diagram of this process can be seen at https://www.cs.utexas.edu/~flame/laff/pfhp/images/Week3/BLISPicturePack.png
-void packB_KCxNC( int k, int n, double *B, int rsB, int csB, double *Bt )
+
+// The kernels above are written out by hand for one tile shape each. DEFINE_UKERNEL writes the same kind of
+// kernel for any MR x NR and either ISA, the way the 24x8 one is written: the accumulators are an array,
+// NR columns of MR/W vectors of W doubles, and with every loop fully unrolled the indices are all constants,
+// so the compiler keeps the whole array in registers (as long as MR/W * NR + MR/W + 1 of them fit).
+// Each ISA is a handful of macros naming its element and vector types and the intrinsics a kernel needs,
+// and MR has to be a multiple of its vector width. The _PS ones are the single precision versions, for SGEMM
+#define AVX2_T            double
+#define AVX2_VEC          __m256d
+#define AVX2_W            4
+#define AVX2_TARGET       "avx2,fma"
+#define AVX2_LOAD( a )    _mm256_load_pd( a )
+#define AVX2_BCAST( b )   _mm256_broadcast_sd( b )
+#define AVX2_FMA          _mm256_fmadd_pd
+#define AVX2_ZERO         _mm256_setzero_pd
+#define AVX2_ADD_C        add_scaled
+#define AVX2_STORE_C      _mm256_storeu_pd
+
+#define AVX512_T          double
+#define AVX512_VEC        __m512d
+#define AVX512_W          8
+#define AVX512_TARGET     "avx512f"
+#define AVX512_LOAD( a )  _mm512_load_pd( a )
+#define AVX512_BCAST( b ) _mm512_set1_pd( *(b) )
+#define AVX512_FMA        _mm512_fmadd_pd
+#define AVX512_ZERO       _mm512_setzero_pd
+#define AVX512_ADD_C      add_scaled_512
+#define AVX512_STORE_C    _mm512_storeu_pd
+
+#define AVX2_PS_T             float
+#define AVX2_PS_VEC           __m256
+#define AVX2_PS_W             8
+#define AVX2_PS_TARGET        "avx2,fma"
+#define AVX2_PS_LOAD( a )     _mm256_load_ps( a )
+#define AVX2_PS_BCAST( b )    _mm256_broadcast_ss( b )
+#define AVX2_PS_FMA           _mm256_fmadd_ps
+#define AVX2_PS_ZERO          _mm256_setzero_ps
+#define AVX2_PS_ADD_C         add_scaled_ps
+#define AVX2_PS_STORE_C       _mm256_storeu_ps
+
+#define AVX512_PS_T           float
+#define AVX512_PS_VEC         __m512
+#define AVX512_PS_W           16
+#define AVX512_PS_TARGET      "avx512f"
+#define AVX512_PS_LOAD( a )   _mm512_load_ps( a )
+#define AVX512_PS_BCAST( b )  _mm512_set1_ps( *(b) )
+#define AVX512_PS_FMA         _mm512_fmadd_ps
+#define AVX512_PS_ZERO        _mm512_setzero_ps
+#define AVX512_PS_ADD_C       add_scaled_ps_512
+#define AVX512_PS_STORE_C     _mm512_storeu_ps
+
+static inline __m256 add_scaled_ps( __m256 acc, float *c, float betaC )
+
+{
+  if (betaC == 0.0f)
+    return acc;
+  return _mm256_fmadd_ps( _mm256_set1_ps( betaC ), _mm256_loadu_ps( c ), acc );
+}
+
+__attribute__((target("avx512f")))
+static inline __m512 add_scaled_ps_512( __m512 acc, float *c, float betaC )
+
+{
+  if (betaC == 0.0f)
+    return acc;
+  return _mm512_fmadd_ps( _mm512_set1_ps( betaC ), _mm512_loadu_ps( c ), acc );
+}
+
+#define DEFINE_UKERNEL( ISA, MR, NR, name ) \
+__attribute__((target(ISA##_TARGET))) \
+void name( int k, ISA##_T *mpA, ISA##_T *mpB, ISA##_T betaC, ISA##_T *C, int rsC, int csC ) \
+{ \
+  _Static_assert( (MR) % ISA##_W == 0, "MR has to be a multiple of the vector width" ); \
+  enum { V = (MR) / ISA##_W }; \
+  ISA##_VEC gamma_j[NR][V], alpha_p[V], beta_p_j; \
+\
+  _Pragma("GCC unroll 16") \
+  for (int j=0; j<(NR); j++) \
+    _Pragma("GCC unroll 16") \
+    for (int v=0; v<V; v++) \
+      gamma_j[j][v] = ISA##_ZERO(); \
+\
+  for ( int p=0; p < k; p++ ) { \
+    _Pragma("GCC unroll 16") \
+    for (int v=0; v<V; v++) \
+      alpha_p[v] = ISA##_LOAD( mpA + v * ISA##_W ); \
+\
+    _Pragma("GCC unroll 16") \
+    for (int j=0; j<(NR); j++) { \
+      beta_p_j = ISA##_BCAST( mpB + j ); \
+      _Pragma("GCC unroll 16") \
+      for (int v=0; v<V; v++) \
+        gamma_j[j][v] = ISA##_FMA( alpha_p[v], beta_p_j, gamma_j[j][v] ); \
+    } \
+\
+    mpA += (MR); \
+    mpB += (NR); \
+  } \
+\
+  _Pragma("GCC unroll 16") \
+  for (int j=0; j<(NR); j++) \
+    _Pragma("GCC unroll 16") \
+    for (int v=0; v<V; v++) \
+      ISA##_STORE_C( &gamma(v * ISA##_W, j), ISA##_ADD_C( gamma_j[j][v], &gamma(v * ISA##_W, j), betaC ) ); \
+}
+
+// The shapes in between the hand-written ones, so the dispatcher (and FIVELOOPS_KERNEL, and the benchmark)
+// have something to choose from. 4x4 and 8x6 are the generated twins of the hand-written kernels
+DEFINE_UKERNEL( AVX2,    4, 4, dgemm_ukernel_gen_avx2_4x4 )
+DEFINE_UKERNEL( AVX2,    8, 4, dgemm_ukernel_gen_avx2_8x4 )
+DEFINE_UKERNEL( AVX2,   12, 4, dgemm_ukernel_gen_avx2_12x4 )
+DEFINE_UKERNEL( AVX2,    8, 6, dgemm_ukernel_gen_avx2_8x6 )
+DEFINE_UKERNEL( AVX512, 16, 8, dgemm_ukernel_gen_avx512_16x8 )
+
+// And the SGEMM kernels: twice the elements per register, so twice the MR for the same register use
+// as the 8x6 and 24x8 double kernels
+DEFINE_UKERNEL( AVX2_PS,    16, 6, sgemm_ukernel_avx2_16x6 )
+DEFINE_UKERNEL( AVX512_PS,  48, 8, sgemm_ukernel_avx512_48x8 )
+
+// The _pf kernels below are the same kernels with the p loop unrolled by 4, software prefetching,
+// and the load of C moved to the end:
+//  - At and Bt are read front to back, so every 4 iterations we prefetch the lines that iteration
+//    p + PREFETCH_A (PREFETCH_B) is going to need. Near the end of the sliver that runs on into the next
+//    sliver of At, which is exactly the one the next kernel call starts with
+//  - the C tile is prefetched on entry and only loaded after the p loop, by which time it should be
+//    in L1, instead of the kernel stalling on it before any work can start
+// Both distances are counted in iterations of the p loop and can be tuned with -D like the block sizes
+#ifndef PREFETCH_A
+#define PREFETCH_A 16
+#endif
+#ifndef PREFETCH_B
+#define PREFETCH_B 16
+#endif
+
+#define PREFETCH_BYTES( ptr, bytes ) \
+  for (int l_=0; l_<(int) (bytes); l_+=64) _mm_prefetch( (const char *) (ptr) + l_, _MM_HINT_T0 )
+
+void dgemm_ukernel_packed_pf( int k, double *mpA, double *mpB, double betaC, double *C, int rsC, int csC )
 
 {
-  for ( int j=0; j<n; j+= NR ){
-    int jb = min( NR, n-j );
-    packB_KCxNR( k, jb, &beta( 0, j ), rsB, csB, Bt );
-    Bt += k * jb;
+  __m256d gamma_0123_0 = _mm256_setzero_pd(), gamma_0123_1 = _mm256_setzero_pd();
+  __m256d gamma_0123_2 = _mm256_setzero_pd(), gamma_0123_3 = _mm256_setzero_pd();
+  __m256d alpha_0123_p, beta_p_j;
+
+  for (int j=0; j<4; j++)
+    PREFETCH_BYTES( &gamma(0,j), 4*sizeof(double) );
+
+  int p = 0;
+  for ( ; p+4 <= k; p+=4 ) {
+    PREFETCH_BYTES( mpA + PREFETCH_A*4, 4*4*sizeof(double) );
+    PREFETCH_BYTES( mpB + PREFETCH_B*4, 4*4*sizeof(double) );
+
+    #pragma GCC unroll 4
+    for (int u=0; u<4; u++) {
+      alpha_0123_p = _mm256_load_pd( mpA );
+
+      beta_p_j     = _mm256_broadcast_sd( mpB );
+      gamma_0123_0 = _mm256_fmadd_pd( alpha_0123_p, beta_p_j, gamma_0123_0 );
+      beta_p_j     = _mm256_broadcast_sd( mpB+1 );
+      gamma_0123_1 = _mm256_fmadd_pd( alpha_0123_p, beta_p_j, gamma_0123_1 );
+      beta_p_j     = _mm256_broadcast_sd( mpB+2 );
+      gamma_0123_2 = _mm256_fmadd_pd( alpha_0123_p, beta_p_j, gamma_0123_2 );
+      beta_p_j     = _mm256_broadcast_sd( mpB+3 );
+      gamma_0123_3 = _mm256_fmadd_pd( alpha_0123_p, beta_p_j, gamma_0123_3 );
+
+      mpA += 4;
+      mpB += 4;
+    }
+  }
+  for ( ; p < k; p++ ) { // the last k % 4 iterations
+    alpha_0123_p = _mm256_load_pd( mpA );
+
+    beta_p_j     = _mm256_broadcast_sd( mpB );
+    gamma_0123_0 = _mm256_fmadd_pd( alpha_0123_p, beta_p_j, gamma_0123_0 );
+    beta_p_j     = _mm256_broadcast_sd( mpB+1 );
+    gamma_0123_1 = _mm256_fmadd_pd( alpha_0123_p, beta_p_j, gamma_0123_1 );
+    beta_p_j     = _mm256_broadcast_sd( mpB+2 );
+    gamma_0123_2 = _mm256_fmadd_pd( alpha_0123_p, beta_p_j, gamma_0123_2 );
+    beta_p_j     = _mm256_broadcast_sd( mpB+3 );
+    gamma_0123_3 = _mm256_fmadd_pd( alpha_0123_p, beta_p_j, gamma_0123_3 );
+
+    mpA += 4;
+    mpB += 4;
   }
+
+  _mm256_storeu_pd( &gamma(0,0), add_scaled( gamma_0123_0, &gamma(0,0), betaC ) );
+  _mm256_storeu_pd( &gamma(0,1), add_scaled( gamma_0123_1, &gamma(0,1), betaC ) );
+  _mm256_storeu_pd( &gamma(0,2), add_scaled( gamma_0123_2, &gamma(0,2), betaC ) );
+  _mm256_storeu_pd( &gamma(0,3), add_scaled( gamma_0123_3, &gamma(0,3), betaC ) );
 }
 
-void packB_KCxNR( int k, int n, double *B, int rsB, int csB, double *Bt )
+// One p iteration of the 8x6 kernel, shared by the unrolled loop and the remainder loop below
+#define STEP_8x6( j ) \
+    beta_p_j        = _mm256_broadcast_sd( mpB+(j) ); \
+    gamma_0123_j[j] = _mm256_fmadd_pd( alpha_0123_p, beta_p_j, gamma_0123_j[j] ); \
+    gamma_4567_j[j] = _mm256_fmadd_pd( alpha_4567_p, beta_p_j, gamma_4567_j[j] );
+
+void dgemm_ukernel_packed_8x6_pf( int k, double *mpA, double *mpB, double betaC, double *C, int rsC, int csC )
 
 {
-  if (n == NR)
-  { // in the case of a "full-size" NR panel
-    for (int p=0;p<k;p++)
-      for (int j=0;j<NR;j++)
-        *Bt++ = beta(p,j); // put elements from B to Bt, one by one
+  __m256d gamma_0123_j[6], gamma_4567_j[6];
+  __m256d alpha_0123_p, alpha_4567_p, beta_p_j;
+
+  for (int j=0; j<6; j++) {
+    gamma_0123_j[j] = _mm256_setzero_pd();
+    gamma_4567_j[j] = _mm256_setzero_pd();
+    PREFETCH_BYTES( &gamma(0,j), 8*sizeof(double) );
   }
-  else
-  {
-    for ( int p=0; p<k; p++ ) {
-      for ( int j=0; j<n; j++ )
-	      *Bt++ = beta( p, j );
-      for ( int j=n; j<NR; j++ ) 
-	      *Bt++ = 0.0; // after packing all elements, pad the rest of the panel with zeros
+
+  int p = 0;
+  for ( ; p+4 <= k; p+=4 ) {
+    PREFETCH_BYTES( mpA + PREFETCH_A*8, 4*8*sizeof(double) );
+    PREFETCH_BYTES( mpB + PREFETCH_B*6, 4*6*sizeof(double) );
+
+    #pragma GCC unroll 4
+    for (int u=0; u<4; u++) {
+      alpha_0123_p = _mm256_load_pd( mpA );
+      alpha_4567_p = _mm256_load_pd( mpA+4 );
+      STEP_8x6(0) STEP_8x6(1) STEP_8x6(2) STEP_8x6(3) STEP_8x6(4) STEP_8x6(5)
+      mpA += 8;
+      mpB += 6;
     }
   }
+  for ( ; p < k; p++ ) {
+    alpha_0123_p = _mm256_load_pd( mpA );
+    alpha_4567_p = _mm256_load_pd( mpA+4 );
+    STEP_8x6(0) STEP_8x6(1) STEP_8x6(2) STEP_8x6(3) STEP_8x6(4) STEP_8x6(5)
+    mpA += 8;
+    mpB += 6;
+  }
+
+  for (int j=0; j<6; j++) {
+    _mm256_storeu_pd( &gamma(0,j), add_scaled( gamma_0123_j[j], &gamma(0,j), betaC ) );
+    _mm256_storeu_pd( &gamma(4,j), add_scaled( gamma_4567_j[j], &gamma(4,j), betaC ) );
+  }
 }
 
-// third loop - Bt is passed in completely, C is split up into MC row-length chunks, A is buffered into At
-void threeloops( int m, int n, int k, double *A, int rsA, int csA, double *Bt,  double *C, int rsC, int csC )
+#define STEP_24x8 \
+    alpha_p[0] = _mm512_load_pd( mpA ); \
+    alpha_p[1] = _mm512_load_pd( mpA+8 ); \
+    alpha_p[2] = _mm512_load_pd( mpA+16 ); \
+    _Pragma("GCC unroll 8") \
+    for (int j=0; j<8; j++) { \
+      beta_p_j      = _mm512_set1_pd( mpB[j] ); \
+      gamma_j[j][0] = _mm512_fmadd_pd( alpha_p[0], beta_p_j, gamma_j[j][0] ); \
+      gamma_j[j][1] = _mm512_fmadd_pd( alpha_p[1], beta_p_j, gamma_j[j][1] ); \
+      gamma_j[j][2] = _mm512_fmadd_pd( alpha_p[2], beta_p_j, gamma_j[j][2] ); \
+    } \
+    mpA += 24; \
+    mpB += 8;
+
+__attribute__((target("avx512f")))
+void dgemm_ukernel_packed_24x8_pf( int k, double *mpA, double *mpB, double betaC, double *C, int rsC, int csC )
 
 {
-  double *At = (double *) _mm_malloc(MC*KC*sizeof(double), (size_t) 64);
+  __m512d gamma_j[8][3], alpha_p[3], beta_p_j;
 
-  for (int i=0; i<m; i+=MC) {
-    int ib = min(MC, m-i);
+  #pragma GCC unroll 8
+  for (int j=0; j<8; j++) {
+    gamma_j[j][0] = gamma_j[j][1] = gamma_j[j][2] = _mm512_setzero_pd();
+    PREFETCH_BYTES( &gamma(0,j), 24*sizeof(double) );
+  }
 
-    packA_MCxKC( ib, k, &alpha(i,0), rsA, csA, At);
+  int p = 0;
+  for ( ; p+4 <= k; p+=4 ) {
+    PREFETCH_BYTES( mpA + PREFETCH_A*24, 4*24*sizeof(double) );
+    PREFETCH_BYTES( mpB + PREFETCH_B*8, 4*8*sizeof(double) );
 
-    twoloops( ib, n, k, At, Bt, &gamma(i,0), rsC, csC );
+    #pragma GCC unroll 4
+    for (int u=0; u<4; u++) {
+      STEP_24x8
+    }
+  }
+  for ( ; p < k; p++ ) {
+    STEP_24x8
   }
 
-  _mm_free(At);
+  #pragma GCC unroll 8
+  for (int j=0; j<8; j++) {
+    _mm512_storeu_pd( &gamma(0, j),  add_scaled_512( gamma_j[j][0], &gamma(0, j), betaC ) );
+    _mm512_storeu_pd( &gamma(8, j),  add_scaled_512( gamma_j[j][1], &gamma(8, j), betaC ) );
+    _mm512_storeu_pd( &gamma(16, j), add_scaled_512( gamma_j[j][2], &gamma(16, j), betaC ) );
+  }
 }
 
-// The same packing process is done with matrix A 
-// (including padding for matrices with sizes that are not multiples of MR)
-void packA_MCxKC( int m, int k, double *A, int rsA, int csA, double *At )
+// The _nt kernels are the _pf ones for betaC == 0 only, for a C that doesn't fit in cache (see stream_C):
+// the tile goes straight from the registers to memory with streaming stores, whole 64-byte lines at a time,
+// so C is never read in and never takes up cache. Which is also why they don't prefetch it.
+// Every column of the tile has to start 64-byte aligned
+__attribute__((target("avx512f")))
+void dgemm_ukernel_packed_24x8_nt( int k, double *mpA, double *mpB, double betaC, double *C, int rsC, int csC )
 
 {
-  for ( int i=0; i<m; i+=MR ) {
-    int ib = min(MR, m-i);
-    packA_MRxKC( ib, k, &alpha(i,0), rsA, csA, At);
-    At += ib * k;
+  __m512d gamma_j[8][3], alpha_p[3], beta_p_j;
+  (void) betaC;
+
+  #pragma GCC unroll 8
+  for (int j=0; j<8; j++)
+    gamma_j[j][0] = gamma_j[j][1] = gamma_j[j][2] = _mm512_setzero_pd();
+
+  int p = 0;
+  for ( ; p+4 <= k; p+=4 ) {
+    PREFETCH_BYTES( mpA + PREFETCH_A*24, 4*24*sizeof(double) );
+    PREFETCH_BYTES( mpB + PREFETCH_B*8, 4*8*sizeof(double) );
+
+    #pragma GCC unroll 4
+    for (int u=0; u<4; u++) {
+      STEP_24x8
+    }
+  }
+  for ( ; p < k; p++ ) {
+    STEP_24x8
+  }
+
+  #pragma GCC unroll 8
+  for (int j=0; j<8; j++) {
+    _mm512_stream_pd( &gamma(0, j),  gamma_j[j][0] );
+    _mm512_stream_pd( &gamma(8, j),  gamma_j[j][1] );
+    _mm512_stream_pd( &gamma(16, j), gamma_j[j][2] );
+  }
+}
+
+// With 8 rows a column of the tile is exactly one line
+void dgemm_ukernel_packed_8x6_nt( int k, double *mpA, double *mpB, double betaC, double *C, int rsC, int csC )
+
+{
+  __m256d gamma_0123_j[6], gamma_4567_j[6];
+  __m256d alpha_0123_p, alpha_4567_p, beta_p_j;
+  (void) betaC;
+
+  for (int j=0; j<6; j++)
+    gamma_0123_j[j] = gamma_4567_j[j] = _mm256_setzero_pd();
+
+  int p = 0;
+  for ( ; p+4 <= k; p+=4 ) {
+    PREFETCH_BYTES( mpA + PREFETCH_A*8, 4*8*sizeof(double) );
+    PREFETCH_BYTES( mpB + PREFETCH_B*6, 4*6*sizeof(double) );
+
+    #pragma GCC unroll 4
+    for (int u=0; u<4; u++) {
+      alpha_0123_p = _mm256_load_pd( mpA );
+      alpha_4567_p = _mm256_load_pd( mpA+4 );
+      STEP_8x6(0) STEP_8x6(1) STEP_8x6(2) STEP_8x6(3) STEP_8x6(4) STEP_8x6(5)
+      mpA += 8;
+      mpB += 6;
+    }
+  }
+  for ( ; p < k; p++ ) {
+    alpha_0123_p = _mm256_load_pd( mpA );
+    alpha_4567_p = _mm256_load_pd( mpA+4 );
+    STEP_8x6(0) STEP_8x6(1) STEP_8x6(2) STEP_8x6(3) STEP_8x6(4) STEP_8x6(5)
+    mpA += 8;
+    mpB += 6;
+  }
+
+  for (int j=0; j<6; j++) {
+    _mm256_stream_pd( &gamma(0,j), gamma_0123_j[j] );
+    _mm256_stream_pd( &gamma(4,j), gamma_4567_j[j] );
   }
 }
 
 
-void packA_MRxKC( int m, int k, double *A, int rsA, int csA, double *At )
+// ---- Other element types ----------------------------------------------------------------------------------
+// SGEMM, DSGEMM (float A and B, double C and arithmetic) and ZGEMM all run the loop nest in fiveloops_gemm.inc,
+// which only differs in what gets packed from what, and which kernels run on the result
+
+// Packing float A and B, the same way pack_sliver packs doubles (4x4 blocks go through _MM_TRANSPOSE4_PS when
+// X's columns are contiguous), either as floats for SGEMM or widened to doubles on the way for DSGEMM.
+// The widened ones are scaled after widening, so a double alpha doesn't get rounded to float first
+static inline void put4_f32( void *P, size_t at, __m128 v, double s, int widen )
 
 {
-  if (m = MR) {
-    for (int p=0; p<k;p++) 
-      for (int i=0; i<MR; i++)
-        *At++ = alpha(i,p);
+  if (widen)
+    _mm256_storeu_pd( (double *) P + at, _mm256_mul_pd( _mm256_set1_pd(s), _mm256_cvtps_pd(v) ) );
+  else
+    _mm_storeu_ps( (float *) P + at, _mm_mul_ps( _mm_set1_ps((float) s), v ) );
+}
 
-  } else {
-    for (int p=0; p<k;p++) 
-      for (int i=0; i<m; i++)
-        *At++ = alpha(i,p);
-      for (int i=m; i<MR; i++)
-        *At++ = 0.0;
+static inline void put1_f32( void *P, size_t at, float v, double s, int widen )
+
+{
+  if (widen)
+    ((double *) P)[at] = s * v;
+  else
+    ((float *) P)[at] = (float) s * v;
+}
+
+static void pack_sliver_f32( int ldp, int w, int k, double s, const float *X, int rsX, int csX, void *P, int widen )
+
+{
+  int p = 0;
+
+  if (csX == 1) {
+    for (; p<k; p++) {
+      const float *x = &X[ p*rsX ];
+      int c = 0;
+      for (; c+4<=w; c+=4)
+        put4_f32( P, (size_t) p*ldp + c, _mm_loadu_ps(&x[c]), s, widen );
+      for (; c<w; c++)
+        put1_f32( P, (size_t) p*ldp + c, x[c], s, widen );
+    }
+  } else if (rsX == 1) {
+    for (; p+4<=k; p+=4) {
+      int c = 0;
+      for (; c+4<=w; c+=4) {
+        const float *x = &X[ p + c*csX ];
+        __m128 r0 = _mm_loadu_ps(x), r1 = _mm_loadu_ps(x + csX),
+               r2 = _mm_loadu_ps(x + 2*csX), r3 = _mm_loadu_ps(x + 3*csX);
+        _MM_TRANSPOSE4_PS(r0, r1, r2, r3);
+        put4_f32( P, (size_t) (p+0)*ldp + c, r0, s, widen );
+        put4_f32( P, (size_t) (p+1)*ldp + c, r1, s, widen );
+        put4_f32( P, (size_t) (p+2)*ldp + c, r2, s, widen );
+        put4_f32( P, (size_t) (p+3)*ldp + c, r3, s, widen );
+      }
+      for (; c<w; c++)
+        for (int pp=p; pp<p+4; pp++)
+          put1_f32( P, (size_t) pp*ldp + c, X[ pp + c*csX ], s, widen );
+    }
   }
+
+  for (; p<k; p++)
+    for (int c=0; c<w; c++)
+      put1_f32( P, (size_t) p*ldp + c, X[ p*rsX + c*csX ], s, widen );
+
+  for (p=0; p<k; p++)
+    for (int c=w; c<ldp; c++)
+      put1_f32( P, (size_t) p*ldp + c, 0.0f, 1.0, widen );
 }
 
-// second loop - At is passed in completely, C and Bt are split up into NR column-wide chunks
-void twoloops( int m, int n, int k, double *At, double *Bt,  double *C, int rsC, int csC )
+// ZGEMM uses the 1m method (Van Zee and Smith, "Implementing High-Performance Complex Matrix Multiplication
+// via the 1m Method", 2017), which turns it into one real multiplication the double kernels can do:
+// with C and B seen as real matrices with the real and imaginary parts of each element in consecutive rows
+// (2m x n and 2k x n), and every element a of A expanded into the real 2x2 block
+//      [ re a  -im a ]
+//      [ im a   re a ]
+// (making A 2m x 2k), the real product is exactly the complex one. The expansion happens while packing A,
+// so all it costs is At being twice the size; B only needs its parts split into two rows.
+// The loops index A and B by real row (and A by real column), and these packers are only ever handed even ones.
+// With A's strides halved, &alpha(2i, 2p) is complex element (i,p), and likewise for B's rows
+struct zgemm_args {
+  double re, im;       // alpha, applied while expanding A
+  int conjA, conjB;    // whether op is the conjugate transpose
+};
+
+static void pack_A_1m( const struct zgemm_args *g, int mr, int m, int k, const double *A, int rsA, int csA,
+       double *At )
 
 {
-  for (int j=0; j<n; j+=NR) {
-    int jb = min(NR, n-j);
+  for (int p=0; p<k/2; p++) {
+    double *re = &At[ (2*p) * mr ], *im = &At[ (2*p+1) * mr ];
+    for (int i=0; i<m/2; i++) {
+      const double *a = &A[ 2 * ((long) i*rsA + (long) p*csA) ];
+      double ar = a[0], ai = g->conjA ? -a[1] : a[1];
+      double xr = g->re * ar - g->im * ai, xi = g->re * ai + g->im * ar;
+      re[2*i] = xr;   re[2*i+1] = xi;
+      im[2*i] = -xi;  im[2*i+1] = xr;
+    }
+    for (int i=m; i<mr; i++)
+      re[i] = im[i] = 0.0;
+  }
+}
 
-    oneloop( m, jb, k, At, &Bt[j*k], &gamma(0,j), rsC, csC );
+static void pack_B_1m( const struct zgemm_args *g, int nr, int k, int n, const double *B, int rsB, int csB,
+       double *Bt )
+
+{
+  for (int p=0; p<k/2; p++) {
+    double *re = &Bt[ (2*p) * nr ], *im = &Bt[ (2*p+1) * nr ];
+    for (int j=0; j<n; j++) {
+      const double *b = &B[ 2 * (long) p*rsB + (long) j*csB ];
+      re[j] = b[0];
+      im[j] = g->conjB ? -b[1] : b[1];
+    }
+    for (int j=n; j<nr; j++)
+      re[j] = im[j] = 0.0;
   }
 }
 
-// first loop - Bt is passed in completely, At and C are split up into MR row-length chunks
-void oneloop( int m, int n, int k, double *At, double *Bt, double *C, int rsC, int csC )
+#define LP( name )        s##name
+#define T_IN              const float
+#define T_PK              float
+#define ALPHA_T           float
+#define BLK_T             fiveloops_sblocking
+#define BLK( ctx )        (&(ctx)->sblk)
+#define PACK_A( g, mr, m, k, A, rsA, csA, At )  pack_sliver_f32( mr, m, k, *(g), A, csA, rsA, At, 0 )
+#define PACK_B( g, nr, k, n, B, rsB, csB, Bt )  pack_sliver_f32( nr, n, k, 1.0, B, rsB, csB, Bt, 0 )
+#define K_STEP            1
+#include "fiveloops_gemm.inc"
+#undef LP
+#undef T_IN
+#undef T_PK
+#undef ALPHA_T
+#undef BLK_T
+#undef BLK
+#undef PACK_A
+#undef PACK_B
+#undef K_STEP
+
+#define LP( name )        ds##name
+#define T_IN              const float
+#define T_PK              double
+#define ALPHA_T           double
+#define BLK_T             fiveloops_blocking
+#define BLK( ctx )        (&(ctx)->blk)
+#define PACK_A( g, mr, m, k, A, rsA, csA, At )  pack_sliver_f32( mr, m, k, *(g), A, csA, rsA, At, 1 )
+#define PACK_B( g, nr, k, n, B, rsB, csB, Bt )  pack_sliver_f32( nr, n, k, 1.0, B, rsB, csB, Bt, 1 )
+#define K_STEP            1
+#include "fiveloops_gemm.inc"
+#undef LP
+#undef T_IN
+#undef T_PK
+#undef ALPHA_T
+#undef BLK_T
+#undef BLK
+#undef PACK_A
+#undef PACK_B
+#undef K_STEP
+
+#define LP( name )        z##name
+#define T_IN              const double
+#define T_PK              double
+#define ALPHA_T           struct zgemm_args
+#define BLK_T             fiveloops_blocking
+#define BLK( ctx )        (&(ctx)->blk)
+#define PACK_A( g, mr, m, k, A, rsA, csA, At )  pack_A_1m( g, mr, m, k, A, rsA, csA, At )
+#define PACK_B( g, nr, k, n, B, rsB, csB, Bt )  pack_B_1m( g, nr, k, n, B, rsB, csB, Bt )
+#define K_STEP            2
+#include "fiveloops_gemm.inc"
+#undef LP
+#undef T_IN
+#undef T_PK
+#undef ALPHA_T
+#undef BLK_T
+#undef BLK
+#undef PACK_A
+#undef PACK_B
+#undef K_STEP
+
+// Strassen, done the ABC way (Huang, Smith, Henry and van de Geijn, "Strassen's Algorithm Reloaded", 2016).
+// One level splits A, B and C into 2x2 blocks and gets C by seven block multiplications instead of eight,
+//      M = (sum of up to two blocks of A) (sum of up to two blocks of B),   added to up to two blocks of C
+// (two levels: 49 of them, with up to four blocks each). Instead of forming those sums in temporaries, the
+// loop nest is run once per M with packers that add the blocks of A (and of B) up as they pack them, and every
+// tile the kernel computes is added into each of the blocks of C it belongs to (STORE_TILE), so the only extra
+// memory traffic is re-reading A and B, and a tile's worth of C, per block.
+//
+// The price is accuracy: the error bound grows with every level (roughly by a factor of 3 to 5 per level for
+// random matrices, and worse in the worst case), which is why it is off by default, limited to two levels and
+// only used for matrices big enough to be worth it. It is the classic form of Strassen rather than Winograd's,
+// which saves additions that cost nothing here anyway, but loses more accuracy
+struct strassen_args {
+  int nA, nB, nC;
+  long offA[4], offB[4], offC[4];     // where each block starts, relative to A, B and C
+  double cA[4], cB[4], cC[4];         // and what it's multiplied with (alpha is in cA)
+};
+
+// Packs the sum of nt w x k slivers of X (starting at X + off[t], times c[t]) into P, like pack_sliver.
+// One block at a time, going down whichever of X's two directions is contiguous
+static void pack_sum( int ldp, int w, int k, int nt, const long *off, const double *c,
+       const double *X, int rsX, int csX, double *P )
 
 {
-  for (int i=0; i<m; i+=MR) {
-    int ib = min(MR, m-i);
+  for (int t=0; t<nt; t++) {
+    const double *Xt = X + off[t];
+    double ct = c[t];
 
-    dgemm_ukernel_packed(k, &At[i*k], Bt, &gamma(i,0), rsC, csC );
+    if (rsX == 1 || csX != 1) {
+      for (int p=0; p<k; p++) {
+        const double *x = &Xt[ (long) p*csX ];
+        double *q = &P[ p*ldp ];
+        int i = 0;
+        if (rsX == 1)
+          for (; i+4<=w; i+=4) {
+            __m256d v = _mm256_mul_pd(_mm256_set1_pd(ct), _mm256_loadu_pd(&x[i]));
+            _mm256_storeu_pd(&q[i], t == 0 ? v : _mm256_add_pd(v, _mm256_loadu_pd(&q[i])));
+          }
+        for (; i<w; i++)
+          q[i] = t == 0 ? ct * x[ (long) i*rsX ] : q[i] + ct * x[ (long) i*rsX ];
+      }
+    } else {
+      for (int i=0; i<w; i++) {
+        const double *x = &Xt[ (long) i*rsX ];
+        if (t == 0)
+          for (int p=0; p<k; p++)
+            P[ p*ldp + i ] = ct * x[p];
+        else
+          for (int p=0; p<k; p++)
+            P[ p*ldp + i ] += ct * x[p];
+      }
+    }
   }
+
+  for (int p=0; p<k; p++)
+    for (int i=w; i<ldp; i++)
+      P[ p*ldp + i ] = 0.0;
 }
 
+static void store_tile_sum( const struct strassen_args *g, int m, int n, const double *Ct, int ldt,
+       double *C, int rsC, int csC )
 
- void dgemm_ukernel_packed(int k, double *mpA, double *mpB, double *C, int rsC, int csC) 
- 
- {
-    // Finally, in the kernel, we have a guarantee that all matrices can be stored in the GPRs
+{
+  for (int t=0; t<g->nC; t++) {
+    double c = g->cC[t], *Cb = C + g->offC[t];
+    __m256d vc = _mm256_set1_pd(c);
+    for (int j=0; j<n; j++) {
+      double *cj = &Cb[ (long) j*csC ];
+      const double *tj = &Ct[ j*ldt ];
+      int i = 0;
+      if (rsC == 1)
+        for (; i+4<=m; i+=4)
+          _mm256_storeu_pd(&cj[i], _mm256_fmadd_pd(vc, _mm256_loadu_pd(&tj[i]), _mm256_loadu_pd(&cj[i])));
+      for (; i<m; i++)
+        cj[ (long) i*rsC ] += c * tj[i];
+    }
+  }
+}
 
-    // We allocate 4 registers for matrix C, and one for mpA and mpB (our slices of A and B) respectively
-    __m256d gamma_0123_0, gamma_0123_1, gamma_0123_2, gamma_0123_3;
-    __m256d alpha_0123_p, beta_p_j;
+#define LP( name )        st##name
+#define T_IN              const double
+#define T_PK              double
+#define ALPHA_T           struct strassen_args
+#define BLK_T             fiveloops_blocking
+#define BLK( ctx )        (&(ctx)->blk)
+#define PACK_A( g, mr, m, k, A, rsA, csA, At )  pack_sum( mr, m, k, (g)->nA, (g)->offA, (g)->cA, A, rsA, csA, At )
+#define PACK_B( g, nr, k, n, B, rsB, csB, Bt )  pack_sum( nr, n, k, (g)->nB, (g)->offB, (g)->cB, B, csB, rsB, Bt )
+#define STORE_TILE( g, m, n, Ct, ldt, C, rsC, csC )  store_tile_sum( g, m, n, Ct, ldt, C, rsC, csC )
+#define K_STEP            1
+#include "fiveloops_gemm.inc"
+#undef LP
+#undef T_IN
+#undef T_PK
+#undef ALPHA_T
+#undef BLK_T
+#undef BLK
+#undef PACK_A
+#undef PACK_B
+#undef STORE_TILE
+#undef K_STEP
 
-    // We load the current contents of C into our registers
-    gamma_0123_0 = _mm256_loadu_pd( &gamma(0, 0) ) ;
-    gamma_0123_1 = _mm256_loadu_pd( &gamma(0, 1) ) ;
-    gamma_0123_2 = _mm256_loadu_pd( &gamma(0, 2) ) ;
-    gamma_0123_3 = _mm256_loadu_pd( &gamma(0, 3) ) ;
+// Which blocks (00, 01, 10, 11) of A, B and C each of the seven products takes, and with what sign:
+// M1 = (A00 + A11)(B00 + B11), M2 = (A10 + A11) B00, M3 = A00 (B01 - B11), M4 = A11 (B10 - B00),
+// M5 = (A00 + A01) B11, M6 = (A10 - A00)(B00 + B01), M7 = (A01 - A11)(B10 + B11), and then
+// C00 += M1 + M4 - M5 + M7, C01 += M3 + M5, C10 += M2 + M4, C11 += M1 - M2 + M3 + M6
+static const signed char strassen_coef[7][3][4] = {
+  { {  1, 0, 0,  1 }, {  1, 0, 0,  1 }, {  1, 0, 0,  1 } },
+  { {  0, 0, 1,  1 }, {  1, 0, 0,  0 }, {  0, 0, 1, -1 } },
+  { {  1, 0, 0,  0 }, {  0, 1, 0, -1 }, {  0, 1, 0,  1 } },
+  { {  0, 0, 0,  1 }, { -1, 0, 1,  0 }, {  1, 0, 1,  0 } },
+  { {  1, 1, 0,  0 }, {  0, 0, 0,  1 }, { -1, 1, 0,  0 } },
+  { { -1, 0, 1,  0 }, {  1, 1, 0,  0 }, {  0, 0, 0,  1 } },
+  { {  0, 1, 0, -1 }, {  0, 0, 1,  1 }, {  1, 0, 0,  0 } },
+};
 
+// Splits each of the n blocks in off/c into the four given by blk, keeping those coef uses
+static void strassen_split( int n, const long *off, const double *c, const signed char *coef, const long *blk,
+       int *n2, long *off2, double *c2 )
 
-    for ( int p=0; p < k; p++){
+{
+  *n2 = 0;
+  for (int t=0; t<n; t++)
+    for (int b=0; b<4; b++)
+      if (coef[b]) {
+        off2[*n2] = off[t] + blk[b];
+        c2[*n2] = c[t] * coef[b];
+        (*n2)++;
+      }
+}
 
-      // aligned load is used ('load' instead of 'loadu'), since A and B are packed, for faster access
-      alpha_0123_p = _mm256_load_pd( mpA ) ;
-      beta_p_j     = _mm256_broadcast_sd( mpB );
-      // loads values into the registers holding values for A and B
-      gamma_0123_0 = _mm256_fmadd_pd( alpha_0123_p, beta_p_j, gamma_0123_0 );
-      // 'fmadd' is a batch multiply-add operation for packed vectors: gamma = alpha * beta + gamma
+// C += the product g describes, through levels more levels of Strassen. m, n and k are divisible by 2^levels
+static void strassen_products( fiveloops_ctx *ctx, const struct strassen_args *g, int levels, int m, int n, int k,
+       double *A, int rsA, int csA, double *B, int rsB, int csB, double *C, int rsC, int csC )
 
-      beta_p_j     = _mm256_broadcast_sd( mpB+1 );
-      gamma_0123_1 = _mm256_fmadd_pd( alpha_0123_p, beta_p_j, gamma_0123_1 );
+{
+  if (levels == 0) {
+    st_fiveloops( ctx, g, m, n, k, A, rsA, csA, B, rsB, csB, 1.0, C, rsC, csC );
+    return;
+  }
 
-      beta_p_j     = _mm256_broadcast_sd( mpB+2 );
-      gamma_0123_2 = _mm256_fmadd_pd( alpha_0123_p, beta_p_j, gamma_0123_2 );
+  int hm = m/2, hn = n/2, hk = k/2;
+  long blkA[4] = { 0, (long) hk*csA, (long) hm*rsA, (long) hm*rsA + (long) hk*csA };
+  long blkB[4] = { 0, (long) hn*csB, (long) hk*rsB, (long) hk*rsB + (long) hn*csB };
+  long blkC[4] = { 0, (long) hn*csC, (long) hm*rsC, (long) hm*rsC + (long) hn*csC };
 
-      beta_p_j     = _mm256_broadcast_sd( mpB+3 );
-      gamma_0123_3 = _mm256_fmadd_pd( alpha_0123_p, beta_p_j, gamma_0123_3 );
-      mpA += MR;
-      mpB += NR;
+  for (int r=0; r<7; r++) {
+    struct strassen_args h;
+    strassen_split( g->nA, g->offA, g->cA, strassen_coef[r][0], blkA, &h.nA, h.offA, h.cA );
+    strassen_split( g->nB, g->offB, g->cB, strassen_coef[r][1], blkB, &h.nB, h.offB, h.cB );
+    strassen_split( g->nC, g->offC, g->cC, strassen_coef[r][2], blkC, &h.nC, h.offC, h.cC );
+    strassen_products( ctx, &h, levels-1, hm, hn, hk, A, rsA, csA, B, rsB, csB, C, rsC, csC );
   }
+}
 
-  // stores the partial result to memory
-  // This is what makes the math work out even when subdividing the matrices like this
-  // C now contains a "partial result" that is reused for later microkernel runs
-  _mm256_storeu_pd( &gamma(0,0), gamma_0123_0 );
-  _mm256_storeu_pd( &gamma(0,1), gamma_0123_1 );
-  _mm256_storeu_pd( &gamma(0,2), gamma_0123_2 );
-  _mm256_storeu_pd( &gamma(0,3), gamma_0123_3 );
- }
+// How many levels of Strassen fiveloops_scaled should use for an m x n x k multiplication
+static int strassen_levels( int m, int n, int k )
+
+{
+  int smallest = min(m, min(n, k)), levels = 0;
+
+  while (levels < strassen_max_levels && (smallest >> levels) >= strassen_min_dim)
+    levels++;
+  return levels;
+}
+
+// C := alphaA AB + betaC C with Strassen on the largest part of it whose sizes are divisible by 2^levels.
+// The few rows and columns left over (fewer than 2^levels of each) are multiplied normally afterwards
+static void fiveloops_strassen( fiveloops_ctx *ctx, int levels, int m, int n, int k, double alphaA,
+       double *A, int rsA, int csA, double *B, int rsB, int csB, double betaC, double *C, int rsC, int csC )
+
+{
+  int ms = m >> levels << levels, ns = n >> levels << levels, ks = k >> levels << levels;
+  struct strassen_args g = { 1, 1, 1, { 0 }, { 0 }, { 0 }, { alphaA }, { 1.0 }, { 1.0 } };
+
+  // Every product adds into C, so beta has to be applied first
+  scale_C( m, n, betaC, C, rsC, csC );
+  strassen_products( ctx, &g, levels, ms, ns, ks, A, rsA, csA, B, rsB, csB, C, rsC, csC );
+
+  if (ks < k)
+    fiveloops_from( ctx, ms, ns, k-ks, alphaA, &alpha(0,ks), rsA, csA, &beta(ks,0), rsB, csB, NULL,
+                    1.0, C, rsC, csC );
+  if (ns < n)
+    fiveloops_from( ctx, ms, n-ns, k, alphaA, A, rsA, csA, &beta(0,ns), rsB, csB, NULL,
+                    1.0, &gamma(0,ns), rsC, csC );
+  if (ms < m)
+    fiveloops_from( ctx, m-ms, n, k, alphaA, &alpha(ms,0), rsA, csA, B, rsB, csB, NULL,
+                    1.0, &gamma(ms,0), rsC, csC );
+}
+
+// C := alpha op(A) op(B) + beta C, all float and column-major, like dgemm
+void sgemm_ex( fiveloops_ctx *ctx, char transA, char transB, int m, int n, int k, float alpha, float *A, int lda,
+       float *B, int ldb, float beta, float *C, int ldc )
+
+{
+  if (m <= 0 || n <= 0)
+    return;
+
+  int rsA, csA, rsB, csB;
+  op_strides( transA, lda, &rsA, &csA );
+  op_strides( transB, ldb, &rsB, &csB );
 
+  if (k <= 0 || alpha == 0.0f) {
+    if (beta != 1.0f)
+      for (int j=0; j<n; j++)
+        for (int i=0; i<m; i++)
+          C[ i + (long) j*ldc ] = beta == 0.0f ? 0.0f : beta * C[ i + (long) j*ldc ];
+    return;
+  }
+
+  s_fiveloops( ctx, &alpha, m, n, k, A, rsA, csA, B, rsB, csB, beta, C, 1, ldc );
+}
+
+void sgemm( char transA, char transB, int m, int n, int k, float alpha, float *A, int lda,
+       float *B, int ldb, float beta, float *C, int ldc )
+
+{
+  sgemm_ex( default_ctx(), transA, transB, m, n, k, alpha, A, lda, B, ldb, beta, C, ldc );
+}
+
+// C := alpha op(A) op(B) + beta C with float A and B but double C, and everything computed in double:
+// A and B are widened while they're packed, and from then on it is the DGEMM kernels doing the work
+void dsgemm_ex( fiveloops_ctx *ctx, char transA, char transB, int m, int n, int k, double alpha,
+       const float *A, int lda, const float *B, int ldb, double beta, double *C, int ldc )
+
+{
+  if (m <= 0 || n <= 0)
+    return;
+
+  int rsA, csA, rsB, csB;
+  op_strides( transA, lda, &rsA, &csA );
+  op_strides( transB, ldb, &rsB, &csB );
+
+  if (k <= 0 || alpha == 0.0) {
+    scale_C( m, n, beta, C, 1, ldc );
+    return;
+  }
+
+  ds_fiveloops( ctx, &alpha, m, n, k, A, rsA, csA, B, rsB, csB, beta, C, 1, ldc );
+}
+
+void dsgemm( char transA, char transB, int m, int n, int k, double alpha, const float *A, int lda,
+       const float *B, int ldb, double beta, double *C, int ldc )
+
+{
+  dsgemm_ex( default_ctx(), transA, transB, m, n, k, alpha, A, lda, B, ldb, beta, C, ldc );
+}
+
+// C := alpha op(A) op(B) + beta C for complex matrices, stored column-major as (real, imaginary) pairs of doubles.
+// alpha and beta point at one such pair each, and op can also be 'C', the conjugate transpose
+void zgemm_ex( fiveloops_ctx *ctx, char transA, char transB, int m, int n, int k, const double *alpha,
+       double *A, int lda, double *B, int ldb, const double *beta, double *C, int ldc )
+
+{
+  if (m <= 0 || n <= 0)
+    return;
+
+  // The kernels can only scale C by something real, so a complex beta gets applied to C up front
+  int no_product = k <= 0 || (alpha[0] == 0.0 && alpha[1] == 0.0);
+  double betaC = beta[0];
+  if (beta[1] != 0.0 || no_product) {
+    int zero = beta[0] == 0.0 && beta[1] == 0.0;
+    if (beta[0] != 1.0 || beta[1] != 0.0)
+      for (int j=0; j<n; j++)
+        for (int i=0; i<m; i++) {
+          double *c = &C[ 2 * (i + (long) j*ldc) ];
+          double cr = c[0], ci = c[1];
+          c[0] = zero ? 0.0 : beta[0] * cr - beta[1] * ci;
+          c[1] = zero ? 0.0 : beta[0] * ci + beta[1] * cr;
+        }
+    betaC = 1.0;
+  }
+  if (no_product)
+    return;
+
+  struct zgemm_args g = { alpha[0], alpha[1], transA == 'C' || transA == 'c', transB == 'C' || transB == 'c' };
+
+  // op_strides gives the strides between complex elements, in complex elements. In doubles those are twice
+  // as big, and A's (which the loops step through by real rows and columns) are half that again
+  int rsA, csA, rsB, csB;
+  op_strides( transA, lda, &rsA, &csA );
+  op_strides( transB, ldb, &rsB, &csB );
+
+  z_fiveloops( ctx, &g, 2*m, n, 2*k, A, rsA, csA, B, rsB, 2*csB, betaC, C, 1, 2*ldc );
+}
+
+void zgemm( char transA, char transB, int m, int n, int k, const double *alpha, double *A, int lda,
+       double *B, int ldb, const double *beta, double *C, int ldc )
+
+{
+  zgemm_ex( default_ctx(), transA, transB, m, n, k, alpha, A, lda, B, ldb, beta, C, ldc );
+}
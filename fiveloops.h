@@ -0,0 +1,274 @@
+/*
+    The interface to fiveloops.c, for code that wants to call it (like fiveloops_bench.c).
+    How it all works is explained in fiveloops.c itself. It needs OpenMP (-fopenmp), which it calls as well as
+    using its pragmas, so there is no serial build: for one thread use fiveloops_set_num_threads(1).
+
+    All matrices are given by a pointer to their first element plus a row stride and a column stride
+    (rsX, csX) in doubles, except for the BLAS-style dgemm* functions, which expect column-major storage
+    with a leading dimension.
+*/
+
+#ifndef FIVELOOPS_H
+#define FIVELOOPS_H
+
+#include <stddef.h>
+
+// All microkernels compute C := At * Bt + betaC * C for one mr x nr tile of C, from an mr-wide sliver of At
+// and an nr-wide sliver of Bt (both packed, k deep). With betaC == 0 they don't read C at all
+typedef void (*dgemm_ukernel_t)( int k, double *mpA, double *mpB, double betaC, double *C, int rsC, int csC );
+
+// Everything the five loops need to know about how to block the matrices
+typedef struct fiveloops_blocking {
+  int mr, nr, mc, kc, nc;
+  dgemm_ukernel_t ukernel;
+  const char *kernel;
+  dgemm_ukernel_t ukernel_nt;   // the same kernel for betaC == 0, storing C with streaming stores; NULL if none
+} fiveloops_blocking;
+
+// The same for SGEMM, whose kernels work on floats
+typedef void (*sgemm_ukernel_t)( int k, float *mpA, float *mpB, float betaC, float *C, int rsC, int csC );
+
+typedef struct fiveloops_sblocking {
+  int mr, nr, mc, kc, nc;
+  sgemm_ukernel_t ukernel;
+  const char *kernel;
+} fiveloops_sblocking;
+
+// Owns the packing buffers (and the thread count and blocking they were sized for)
+typedef struct fiveloops_ctx fiveloops_ctx;
+
+// Where the time went, per loop. Only filled in when fiveloops.c is built with -DFIVELOOPS_STATS;
+// otherwise the counters stay zero and the instrumentation isn't compiled in at all.
+// Cycles are TSC ticks summed over every thread that ran that part (so with T threads the inner loops can add
+// up to T times the wall time), and the packing cycles include waiting for the other threads to finish packing.
+// Each loop's cycles include the loops (and packing) inside it
+typedef struct fiveloops_stats {
+  unsigned long long calls;
+  unsigned long long cycles_loop5, cycles_loop4, cycles_loop3, cycles_loop2, cycles_loop1;
+  unsigned long long cycles_pack_A, cycles_pack_B;
+  unsigned long long bytes_packed_A, bytes_packed_B;   // including the zero padding
+  unsigned long long kernel_calls, fringe_calls;        // full tiles, and tiles that went through ukernel_fringe
+} fiveloops_stats;
+
+// B packed once, to be multiplied with any number of A's (see fiveloops_pack_B)
+typedef struct fiveloops_packed_B fiveloops_packed_B;
+
+typedef void (*fiveloops_stats_callback)( const fiveloops_stats *call, void *user );
+
+void fiveloops_set_num_threads( int nthreads );
+
+// Opt-in Strassen for very big multiplications (fiveloops_scaled, and so also dgemm): up to levels levels
+// (0 = off, which is the default, and at most 2), each taken only while the smallest of m, n and k is at
+// least min_dim (0 for the default of 4096). Every level saves 1/8 of the flops but loses some accuracy
+void fiveloops_set_strassen( int levels, int min_dim );
+
+// An accelerator for fiveloops_scaled (and so dgemm) to hand the biggest multiplications to. B comes over
+// in KC x NC panels packed by packB_KCxNC: NR-wide slivers, each pb x NR and stored row by row, with the last
+// one padded out with zeros. A and C go over however the backend likes. All of the functions return 0
+// on success; if any of them fails, the whole multiplication is done again on the host
+typedef struct fiveloops_offload {
+  const char *name;
+  void *user;   // passed to all of them
+
+  // Starts on C := alphaA AB + betaC C, m x n x k, with B coming in panels blocked by nr, kc and nc.
+  // The backend mustn't write to C before end
+  int (*begin)( void *user, int m, int n, int k, int nr, int kc, int nc, double alphaA,
+         const double *A, int rsA, int csA, double *C, int rsC, int csC );
+  // Starts copying the pb x jb panel Bt over, as the rows p.. and columns j.. of B, into slot (0 or 1), and
+  // then C(:, j..) := alphaA A(:, p..) Bt + betaC C(:, j..), without waiting for either to finish
+  int (*panel)( void *user, int slot, int j, int p, int jb, int pb, const double *Bt, double betaC );
+  // Waits until the host can pack the next panel into the buffer last sent through slot
+  int (*sync)( void *user, int slot );
+  // Waits for everything, and copies C back if ok (and leaves it alone if not)
+  int (*end)( void *user, int ok );
+} fiveloops_offload;
+
+// Hands every multiplication of at least min_flops (0 for the default of 1e10) to backend from now on,
+// or nothing, if backend is NULL. Smaller ones stay on the host
+void fiveloops_set_offload( const fiveloops_offload *backend, double min_flops );
+
+// Reproducible mode: the contexts created while it is on (and the default ones) give bitwise the same results
+// on every run, whatever the thread count, host or kernel (FIVELOOPS_KERNEL, fiveloops_ctx_create_kernel), by
+// fixing KC and never splitting k between threads. Every kernel sums in the same order, so any of them will do.
+// Strassen, if switched on, and the paths for skinny shapes still apply: they only depend on the shape.
+// B packed by fiveloops_pack_B in one mode can't be used by contexts in the other
+void fiveloops_set_reproducible( int on );
+
+// The blocking (and kernel) chosen for this host
+const fiveloops_blocking *fiveloops_host_blocking( void );
+
+const fiveloops_sblocking *fiveloops_host_sblocking( void );
+
+// Fills in the names of the microkernels this host can run, best first, and returns how many there are
+int fiveloops_kernels( const char **names, int max );
+
+// On a NUMA host, and for shapes it splits between groups of threads, a context runs nested parallel regions.
+// For the length of those calls the calling thread's OpenMP max active levels go up to 2 (if they're below it),
+// and are put back afterwards
+fiveloops_ctx *fiveloops_ctx_create( int nthreads );
+// Same, but blocked for the named kernel instead of the host's choice. NULL if the host can't run it
+fiveloops_ctx *fiveloops_ctx_create_kernel( int nthreads, const char *kernel );
+const fiveloops_blocking *fiveloops_ctx_blocking( const fiveloops_ctx *ctx );
+void fiveloops_ctx_free( fiveloops_ctx *ctx );
+
+// Totals over every call (and context) since the last reset
+void fiveloops_stats_get( fiveloops_stats *total );
+void fiveloops_stats_reset( void );
+// cb gets the stats of each call as it finishes (NULL to stop)
+void fiveloops_stats_set_callback( fiveloops_stats_callback cb, void *user );
+
+// C := AB + C
+void fiveloops( int m, int n, int k, double *A, int rsA, int csA,
+       double *B, int rsB, int csB, double *C, int rsC, int csC );
+void fiveloops_ex( fiveloops_ctx *ctx, int m, int n, int k, double *A, int rsA, int csA,
+       double *B, int rsB, int csB, double *C, int rsC, int csC );
+
+// C := alphaA AB + betaC C (just betaC C for k == 0)
+void fiveloops_scaled( fiveloops_ctx *ctx, int m, int n, int k, double alphaA, double *A, int rsA, int csA,
+       double *B, int rsB, int csB, double betaC, double *C, int rsC, int csC );
+
+// C := alpha op(A) op(B) + beta C, column-major, transA/transB = 'N' or 'T'
+void dgemm( char transA, char transB, int m, int n, int k, double alpha, double *A, int lda,
+       double *B, int ldb, double beta, double *C, int ldc );
+void dgemm_ex( fiveloops_ctx *ctx, char transA, char transB, int m, int n, int k, double alpha, double *A, int lda,
+       double *B, int ldb, double beta, double *C, int ldc );
+
+// Packs the k x n matrix B for multiplications with ctx (or any context that blocks the same way).
+// NULL if out of memory
+fiveloops_packed_B *fiveloops_pack_B( fiveloops_ctx *ctx, int k, int n, double *B, int rsB, int csB );
+// The same for the default context, with B column-major and transB = 'N' or 'T'
+fiveloops_packed_B *dgemm_pack_B( char transB, int k, int n, double *B, int ldb );
+void fiveloops_packed_B_free( fiveloops_packed_B *Bp );
+
+// C := alphaA A Bp + betaC C and C := alpha op(A) Bp + beta C, with A m x k (k and n come from Bp).
+// Both return -1 and leave C alone if Bp was packed for a context blocked differently from this one
+int fiveloops_scaled_packed( fiveloops_ctx *ctx, int m, double alphaA, double *A, int rsA, int csA,
+       const fiveloops_packed_B *Bp, double betaC, double *C, int rsC, int csC );
+int dgemm_packed( char transA, int m, double alpha, double *A, int lda,
+       const fiveloops_packed_B *Bp, double beta, double *C, int ldc );
+
+// C := alphaA AB + betaC C (and the dgemm equivalent) for matrices too big to fit in memory, eg mapped from
+// files with fiveloops_map_file: the next panel of B is read in and packed while the current one computes.
+// Both return -1 and leave C alone if the extra packing buffer this needs can't be mapped
+int fiveloops_streamed( fiveloops_ctx *ctx, int m, int n, int k, double alphaA, double *A, int rsA, int csA,
+       double *B, int rsB, int csB, double betaC, double *C, int rsC, int csC );
+int dgemm_streamed( char transA, char transB, int m, int n, int k, double alpha, double *A, int lda,
+       double *B, int ldb, double beta, double *C, int ldc );
+// Maps the first bytes of a file as doubles, read-only or (for C) writable, creating or growing the file
+// as needed. NULL on failure
+double *fiveloops_map_file( const char *path, size_t bytes, int writable );
+void fiveloops_unmap_file( double *p, size_t bytes );
+
+// Calls queued to run on worker threads (see fiveloops_submit in fiveloops.c). Every worker has its own context,
+// running the loops on nthreads threads (0 for the default), so workers * nthreads shouldn't be more than
+// there are cores. NULL if the threads or their buffers can't be had
+typedef struct fiveloops_queue fiveloops_queue;
+typedef struct fiveloops_future fiveloops_future;
+typedef void (*fiveloops_done_callback)( fiveloops_future *f, void *user );
+
+fiveloops_queue *fiveloops_queue_create( int workers, int nthreads );
+// Waits for everything still queued. All of the queue's futures have to be freed before this
+void fiveloops_queue_free( fiveloops_queue *q );
+
+// Each of these runs once the nafter futures in after (from the same queue; NULL ones are skipped) are done,
+// and doesn't if any of them failed. The matrices have to stay put until it's done. NULL if out of memory.
+// fiveloops_submit_packed multiplies with the B packed by a fiveloops_submit_pack_B job, which waits for that
+// as well; the packed B is then the caller's, from fiveloops_future_packed_B, to free with fiveloops_packed_B_free
+fiveloops_future *fiveloops_submit( fiveloops_queue *q, int m, int n, int k, double alphaA, double *A, int rsA, int csA,
+       double *B, int rsB, int csB, double betaC, double *C, int rsC, int csC,
+       fiveloops_future *const *after, int nafter );
+fiveloops_future *fiveloops_submit_pack_B( fiveloops_queue *q, int k, int n, double *B, int rsB, int csB,
+       fiveloops_future *const *after, int nafter );
+fiveloops_future *fiveloops_submit_packed( fiveloops_queue *q, int m, double alphaA, double *A, int rsA, int csA,
+       fiveloops_future *packed, double betaC, double *C, int rsC, int csC,
+       fiveloops_future *const *after, int nafter );
+
+// 0 once f has run, -1 if it (or something it waited for) failed
+int fiveloops_future_wait( fiveloops_future *f );
+int fiveloops_future_done( fiveloops_future *f );
+// cb(f, user) once f is done: on the worker that ran it, or straight away if it already has
+void fiveloops_future_on_done( fiveloops_future *f, fiveloops_done_callback cb, void *user );
+fiveloops_packed_B *fiveloops_future_packed_B( fiveloops_future *f );
+// Doesn't cancel f, just lets go of it
+void fiveloops_future_free( fiveloops_future *f );
+
+// What fiveloops_scaled_epilogue and dgemm_epilogue do to every element of C once the multiplication is done,
+// while it is still in registers: add bias_m[i] to row i and bias_n[j] to column j (either can be NULL),
+// then apply act. GELU is the usual tanh approximation, x (1 + tanh(sqrt(2/pi) (x + 0.044715 x^3))) / 2
+enum { FIVELOOPS_ACT_NONE, FIVELOOPS_ACT_RELU, FIVELOOPS_ACT_GELU };
+
+typedef struct fiveloops_epilogue {
+  const double *bias_m;
+  const double *bias_n;
+  int act;
+} fiveloops_epilogue;
+
+// C := act( alphaA AB + betaC C + bias ), and the same for the dgemm interface. ep NULL is a plain multiplication
+void fiveloops_scaled_epilogue( fiveloops_ctx *ctx, int m, int n, int k, double alphaA, double *A, int rsA, int csA,
+       double *B, int rsB, int csB, double betaC, double *C, int rsC, int csC, const fiveloops_epilogue *ep );
+void dgemm_epilogue( char transA, char transB, int m, int n, int k, double alpha, double *A, int lda,
+       double *B, int ldb, double beta, double *C, int ldc, const fiveloops_epilogue *ep );
+
+// The same for other element types: all float, float A and B with double C (and double arithmetic),
+// and complex double, stored as (real, imaginary) pairs, with alpha and beta pointing at one pair each
+// and transA/transB = 'N', 'T' or 'C'
+void sgemm( char transA, char transB, int m, int n, int k, float alpha, float *A, int lda,
+       float *B, int ldb, float beta, float *C, int ldc );
+void sgemm_ex( fiveloops_ctx *ctx, char transA, char transB, int m, int n, int k, float alpha, float *A, int lda,
+       float *B, int ldb, float beta, float *C, int ldc );
+void dsgemm( char transA, char transB, int m, int n, int k, double alpha, const float *A, int lda,
+       const float *B, int ldb, double beta, double *C, int ldc );
+void dsgemm_ex( fiveloops_ctx *ctx, char transA, char transB, int m, int n, int k, double alpha,
+       const float *A, int lda, const float *B, int ldb, double beta, double *C, int ldc );
+void zgemm( char transA, char transB, int m, int n, int k, const double *alpha, double *A, int lda,
+       double *B, int ldb, const double *beta, double *C, int ldc );
+void zgemm_ex( fiveloops_ctx *ctx, char transA, char transB, int m, int n, int k, const double *alpha,
+       double *A, int lda, double *B, int ldb, const double *beta, double *C, int ldc );
+
+void dgemm_batched( char transA, char transB, int m, int n, int k, double alpha,
+       double **A, int lda, double **B, int ldb, double beta, double **C, int ldc, int batch );
+void dgemm_batched_ex( fiveloops_ctx *ctx, char transA, char transB, int m, int n, int k, double alpha,
+       double **A, int lda, double **B, int ldb, double beta, double **C, int ldc, int batch );
+void dgemm_strided_batched( char transA, char transB, int m, int n, int k, double alpha,
+       double *A, int lda, long strideA, double *B, int ldb, long strideB, double beta,
+       double *C, int ldc, long strideC, int batch );
+void dgemm_strided_batched_ex( fiveloops_ctx *ctx, char transA, char transB, int m, int n, int k, double alpha,
+       double *A, int lda, long strideA, double *B, int ldb, long strideB, double beta,
+       double *C, int ldc, long strideC, int batch );
+
+// The loops, packing routines and kernels themselves, outermost first
+void fourloops( fiveloops_ctx *ctx, int m, int n, int k, double alphaA, double *A, int rsA, int csA,
+       double *B, int rsB, int csB, double betaC, double *C, int rsC, int csC );
+void packB_KCxNC( int nr, int k, int n, double *B, int rsB, int csB, double *Bt );
+void packB_KCxNR( int nr, int k, int n, double *B, int rsB, int csB, double *Bt );
+void threeloops( fiveloops_ctx *ctx, int m, int n, int k, double alphaA, double *A, int rsA, int csA,
+       double *Bt, double *At, int split_ic, double betaC, double *C, int rsC, int csC );
+void packA_MCxKC( int mr, int m, int k, double alphaA, double *A, int rsA, int csA, double *At );
+void packA_MRxKC( int mr, int m, int k, double alphaA, double *A, int rsA, int csA, double *At );
+void twoloops( fiveloops_ctx *ctx, int m, int n, int k, double *At, double *Bt, int split_jr,
+       double betaC, double *C, int rsC, int csC );
+void oneloop( fiveloops_ctx *ctx, int m, int n, int k, double *At, double *Bt, double betaC,
+       double *C, int rsC, int csC );
+
+void dgemm_ukernel_packed( int k, double *mpA, double *mpB, double betaC, double *C, int rsC, int csC );
+void dgemm_ukernel_packed_8x6( int k, double *mpA, double *mpB, double betaC, double *C, int rsC, int csC );
+void dgemm_ukernel_packed_24x8( int k, double *mpA, double *mpB, double betaC, double *C, int rsC, int csC );
+void dgemm_ukernel_packed_pf( int k, double *mpA, double *mpB, double betaC, double *C, int rsC, int csC );
+void dgemm_ukernel_packed_8x6_pf( int k, double *mpA, double *mpB, double betaC, double *C, int rsC, int csC );
+void dgemm_ukernel_packed_24x8_pf( int k, double *mpA, double *mpB, double betaC, double *C, int rsC, int csC );
+
+// The _pf kernels for betaC == 0 and C's columns 64-byte aligned, writing C past the caches
+void dgemm_ukernel_packed_8x6_nt( int k, double *mpA, double *mpB, double betaC, double *C, int rsC, int csC );
+void dgemm_ukernel_packed_24x8_nt( int k, double *mpA, double *mpB, double betaC, double *C, int rsC, int csC );
+
+// Kernels generated by DEFINE_UKERNEL, named by the ISA and the tile shape
+void dgemm_ukernel_gen_avx2_4x4( int k, double *mpA, double *mpB, double betaC, double *C, int rsC, int csC );
+void dgemm_ukernel_gen_avx2_8x4( int k, double *mpA, double *mpB, double betaC, double *C, int rsC, int csC );
+void dgemm_ukernel_gen_avx2_12x4( int k, double *mpA, double *mpB, double betaC, double *C, int rsC, int csC );
+void dgemm_ukernel_gen_avx2_8x6( int k, double *mpA, double *mpB, double betaC, double *C, int rsC, int csC );
+void dgemm_ukernel_gen_avx512_16x8( int k, double *mpA, double *mpB, double betaC, double *C, int rsC, int csC );
+
+void sgemm_ukernel_avx2_16x6( int k, float *mpA, float *mpB, float betaC, float *C, int rsC, int csC );
+void sgemm_ukernel_avx512_48x8( int k, float *mpA, float *mpB, float betaC, float *C, int rsC, int csC );
+
+#endif
@@ -0,0 +1,631 @@
+/*
+    GFLOPs benchmark for fiveloops.c, to reproduce the "90-95% of BLIS" number from there and to keep an eye
+    on it across changes and CPU models.
+
+    It times dgemm over three sweeps:
+      square    m = n = k, from --step up to --max
+      skinny    one of m, n or k small (16 and 64), the other two --max
+      layout    the four transpose combinations, with tight and with padded (unaligned) leading dimensions
+    and for each shape reports GFLOPs, the percentage of the theoretical peak, and (when built against a
+    reference BLAS) the reference's GFLOPs, our percentage of it, and the largest difference between the results.
+
+    The peak is clock * FMA flops per cycle * threads. The clock is measured with a chain of dependent adds
+    (one cycle each) unless given with --ghz; the flops per cycle default to 2 FMA units' worth for the kernel's
+    vector width (16 for AVX2, 32 for AVX-512) and can be overridden with --flops-per-cycle for CPUs with one unit.
+
+    With --suite it runs the regression suite instead, on one thread, with every piece timed in isolation:
+      kernels   every microkernel the host can run on a full tile (k = KC, everything in L1), the same kernel
+                on an (MR-1) x (NR-1) fringe tile through oneloop, the streaming _nt variant where there is one,
+                and the host's SGEMM kernel. In flops per cycle, against the FMA peak
+      packers   packA_MRxKC, packA_MCxKC, packB_KCxNR and packB_KCxNC from column-major, row-major and strided
+                matrices, block sized for the host kernel. In bytes (read and written) per cycle, against
+                a plain copy of the same number of bytes, measured the same way
+    Every result is also given as a percentage of its roof, which is what gets compared with a baseline:
+    --save-baseline FILE writes them out, and --baseline FILE compares against them, flags anything that has
+    dropped more than --threshold percent (10 by default) and exits with status 1 if anything has.
+    Baselines only mean anything on the host they were recorded on, so the file notes which CPU that was.
+    Give the clock with --ghz when comparing, or the measurement of it adds its own noise to every kernel.
+
+    Build:
+      cc -O3 -mavx2 -mfma -fopenmp fiveloops.c fiveloops_bench.c -o fiveloops_bench
+    and to compare against a reference BLAS, add -DHAVE_CBLAS and one of -lopenblas, -lblis or -lmkl_rt.
+    -fopenmp isn't optional, fiveloops.c won't link without it
+
+    Usage:
+      fiveloops_bench [--sweep square|skinny|layout|all] [--max N] [--step N] [--threads N]
+                      [--kernel NAME|all] [--ghz F] [--flops-per-cycle F] [--format table|csv|json]
+      fiveloops_bench --suite kernels|packers|all [--baseline FILE] [--save-baseline FILE] [--threshold PCT]
+                      [--ghz F] [--flops-per-cycle F] [--format table|csv|json]
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <time.h>
+
+#ifdef HAVE_CBLAS
+#include <cblas.h>
+#endif
+
+#include "fiveloops.h"
+
+static double now( void )
+
+{
+  struct timespec t;
+  clock_gettime(CLOCK_MONOTONIC, &t);
+  return t.tv_sec + 1e-9 * t.tv_nsec;
+}
+
+// Each iteration is 8 adds that depend on each other, so 8 cycles whatever the CPU
+static double measure_ghz( void )
+
+{
+  long iters = 50000000;
+  unsigned long x = 0;
+  double t = now();
+  for (long i=0; i<iters; i++)
+    __asm__ volatile( "add $1, %0\n\tadd $1, %0\n\tadd $1, %0\n\tadd $1, %0\n\t"
+                      "add $1, %0\n\tadd $1, %0\n\tadd $1, %0\n\tadd $1, %0" : "+r"(x) );
+  t = now() - t;
+  return 8.0 * iters / t * 1e-9;
+}
+
+static void cpu_model( char *buf, size_t len )
+
+{
+  snprintf(buf, len, "unknown");
+  FILE *f = fopen("/proc/cpuinfo", "r");
+  if (!f)
+    return;
+  char line[256];
+  while (fgets(line, sizeof(line), f))
+    if (!strncmp(line, "model name", 10)) {
+      char *v = strchr(line, ':');
+      if (v) {
+        v += 1 + strspn(v + 1, " \t");
+        v[strcspn(v, "\n")] = 0;
+        snprintf(buf, len, "%s", v);
+      }
+      break;
+    }
+  fclose(f);
+}
+
+struct shape {
+  const char *sweep;
+  int m, n, k;
+  char transA, transB;
+  int pad;          // extra elements in every leading dimension
+};
+
+#define MAX_SHAPES 128
+
+// Adds shape to the list unless it is full already, in which case *count goes past MAX_SHAPES to say so
+static void add_shape( struct shape *s, int *count, struct shape shape )
+
+{
+  if (*count < MAX_SHAPES)
+    s[*count] = shape;
+  (*count)++;
+}
+
+// Returns how many shapes the sweep has, or -1 if that's more than MAX_SHAPES
+static int make_shapes( const char *sweep, int max, int step, struct shape *s )
+
+{
+  int count = 0, all = !strcmp(sweep, "all");
+
+  if (all || !strcmp(sweep, "square"))
+    for (int d=step; d<=max && count<=MAX_SHAPES; d+=step)
+      add_shape(s, &count, (struct shape) { "square", d, d, d, 'N', 'N', 0 });
+
+  if (all || !strcmp(sweep, "skinny")) {
+    int small[] = { 16, 64 };
+    for (int i=0; i<2; i++) {
+      add_shape(s, &count, (struct shape) { "skinny", small[i], max, max, 'N', 'N', 0 });
+      add_shape(s, &count, (struct shape) { "skinny", max, small[i], max, 'N', 'N', 0 });
+      add_shape(s, &count, (struct shape) { "skinny", max, max, small[i], 'N', 'N', 0 });
+    }
+  }
+
+  if (all || !strcmp(sweep, "layout")) {
+    const char *trans[] = { "NN", "NT", "TN", "TT" };
+    int d = max / 2;
+    for (int t=0; t<4; t++)
+      for (int pad=0; pad<=67; pad+=67)
+        add_shape(s, &count, (struct shape) { "layout", d, d, d, trans[t][0], trans[t][1], pad });
+  }
+  return count > MAX_SHAPES ? -1 : count;
+}
+
+struct result {
+  double seconds, gflops, pct_peak;
+  double ref_gflops, pct_ref, max_err;   // negative when there is no reference BLAS
+};
+
+// Runs f until it has had at least 0.2s (and 3 runs) after a warm-up run, and returns the best time
+#define BEST_TIME( best, f ) \
+  do { \
+    f; \
+    best = 1e30; \
+    double start_ = now(); \
+    for (int r_=0; r_<3 || now() - start_ < 0.2; r_++) { \
+      double t_ = now(); \
+      f; \
+      t_ = now() - t_; \
+      if (t_ < best) best = t_; \
+    } \
+  } while (0)
+
+static struct result run_shape( fiveloops_ctx *ctx, const struct shape *s, double peak_gflops )
+
+{
+  int m = s->m, n = s->n, k = s->k;
+  int rowsA = s->transA == 'N' ? m : k, colsA = s->transA == 'N' ? k : m;
+  int rowsB = s->transB == 'N' ? k : n, colsB = s->transB == 'N' ? n : k;
+  int lda = rowsA + s->pad, ldb = rowsB + s->pad, ldc = m + s->pad;
+
+  double *A = malloc(sizeof(double) * lda * colsA);
+  double *B = malloc(sizeof(double) * ldb * colsB);
+  double *C = malloc(sizeof(double) * ldc * n);
+  for (long i=0; i<(long) lda * colsA; i++) A[i] = (double) rand() / RAND_MAX - 0.5;
+  for (long i=0; i<(long) ldb * colsB; i++) B[i] = (double) rand() / RAND_MAX - 0.5;
+  for (long i=0; i<(long) ldc * n; i++)     C[i] = 0.0;
+
+  double flops = 2.0 * m * n * k;
+  struct result r = { 0, 0, 0, -1, -1, -1 };
+
+  // beta = 0, so that repeating the call doesn't change the result
+  BEST_TIME( r.seconds, dgemm_ex( ctx, s->transA, s->transB, m, n, k, 1.0, A, lda, B, ldb, 0.0, C, ldc ) );
+  r.gflops = flops / r.seconds * 1e-9;
+  r.pct_peak = 100.0 * r.gflops / peak_gflops;
+
+#ifdef HAVE_CBLAS
+  double *R = malloc(sizeof(double) * ldc * n);
+  double ref;
+  BEST_TIME( ref, cblas_dgemm( CblasColMajor, s->transA == 'N' ? CblasNoTrans : CblasTrans,
+                               s->transB == 'N' ? CblasNoTrans : CblasTrans,
+                               m, n, k, 1.0, A, lda, B, ldb, 0.0, R, ldc ) );
+  r.ref_gflops = flops / ref * 1e-9;
+  r.pct_ref = 100.0 * r.gflops / r.ref_gflops;
+  r.max_err = 0.0;
+  for (int j=0; j<n; j++)
+    for (int i=0; i<m; i++)
+      r.max_err = fmax(r.max_err, fabs(C[i + j*ldc] - R[i + j*ldc]));
+  free(R);
+#endif
+
+  free(A);
+  free(B);
+  free(C);
+  return r;
+}
+
+// Before timing anything: k == 0 has nothing to multiply, so C := AB + C leaves C as it was and betaC C
+// just scales it, whichever of the paths (tiny, skinny or the five loops) the shape would have taken.
+// Returns 0 if any of them got it wrong
+static int k0_ok( fiveloops_ctx *ctx )
+
+{
+  int sizes[][2] = { { 4, 4 }, { 100, 100 }, { 2000, 3 }, { 3, 2000 } };
+  double a = 1.0, b = 1.0;
+  for (int t=0; t<4; t++) {
+    int m = sizes[t][0], n = sizes[t][1];
+    double *C = malloc(sizeof(double) * m * n);
+    for (long i=0; i<(long) m * n; i++) C[i] = 1.0;
+    fiveloops_ex( ctx, m, n, 0, &a, 1, m, &b, 1, 1, C, 1, m );
+    fiveloops_scaled( ctx, m, n, 0, 1.0, &a, 1, m, &b, 1, 1, 2.0, C, 1, m );
+    int ok = 1;
+    for (long i=0; i<(long) m * n; i++)
+      ok &= C[i] == 2.0;
+    free(C);
+    if (!ok)
+      return 0;
+  }
+  return 1;
+}
+
+// ---- The regression suite ------------------------------------------------------------------------------------
+// Each result is one item: a name (no spaces, so that the baseline file can be read back with fscanf),
+// a size, the rate measured, its roof, and what the baseline had as the percentage of the roof
+
+#define MAX_ITEMS 128
+
+struct item {
+  char name[64], size[32];
+  const char *unit;
+  double rate, roof, pct;
+  double base_pct;    // negative if the baseline doesn't have it
+};
+
+struct suite {
+  double ghz;
+  struct item items[MAX_ITEMS];
+  int count;
+};
+
+static struct item *suite_add( struct suite *st, const char *unit, double rate, double roof )
+
+{
+  if (st->count == MAX_ITEMS)
+    return NULL;
+  struct item *it = &st->items[st->count++];
+  it->unit = unit;
+  it->rate = rate;
+  it->roof = roof;
+  it->pct = 100.0 * rate / roof;
+  it->base_pct = -1.0;
+  return it;
+}
+
+static double *random_buffer( long n )
+
+{
+  // 2MB aligned, for the kernels' aligned loads (and streaming stores) and so no offset within a page can matter
+  double *x = aligned_alloc(2 << 20, (sizeof(double) * n + (2 << 20) - 1) / (2 << 20) * (2 << 20));
+  for (long i=0; i<n; i++)
+    x[i] = (double) rand() / RAND_MAX - 0.5;
+  return x;
+}
+
+// Small enough not to overflow however often C gets added onto
+#define KERNEL_REPS 1000
+
+static void suite_kernels( struct suite *st, double flops_per_cycle )
+
+{
+  const char *kernels[32];
+  int nkernels = fiveloops_kernels(kernels, 32);
+  nkernels = nkernels > 32 ? 32 : nkernels;
+
+  for (int kn=0; kn<nkernels; kn++) {
+    fiveloops_ctx *ctx = fiveloops_ctx_create_kernel(1, kernels[kn]);
+    if (!ctx)
+      continue;
+    const fiveloops_blocking *b = fiveloops_ctx_blocking(ctx);
+    int mr = b->mr, nr = b->nr, kc = b->kc;
+    double fpc = flops_per_cycle > 0.0 ? flops_per_cycle : strstr(b->kernel, "avx512") ? 32.0 : 16.0;
+    double cycles = st->ghz * 1e9, t;
+    struct item *it;
+
+    // The streaming variant writes a fresh tile every time, mostly out of cache, the way it's meant to be used
+    long tiles = ((long) 64 << 20) / (sizeof(double) * mr * nr);
+    double *At = random_buffer((long) mr * kc), *Bt = random_buffer((long) nr * kc);
+    double *C = random_buffer(tiles * mr * nr);
+
+    BEST_TIME( t, for (int r=0; r<KERNEL_REPS; r++) b->ukernel( kc, At, Bt, 1.0, C, 1, mr ) );
+    if ((it = suite_add( st, "flop/cycle", 2.0 * mr * nr * kc * KERNEL_REPS / (t * cycles), fpc ))) {
+      snprintf(it->name, sizeof(it->name), "kernel/%s", b->kernel);
+      snprintf(it->size, sizeof(it->size), "%dx%dx%d", mr, nr, kc);
+    }
+
+    BEST_TIME( t, for (int r=0; r<KERNEL_REPS; r++) oneloop( ctx, mr-1, nr-1, kc, At, Bt, 1.0, C, 1, mr ) );
+    if ((it = suite_add( st, "flop/cycle", 2.0 * (mr-1) * (nr-1) * kc * KERNEL_REPS / (t * cycles), fpc ))) {
+      snprintf(it->name, sizeof(it->name), "fringe/%s", b->kernel);
+      snprintf(it->size, sizeof(it->size), "%dx%dx%d", mr-1, nr-1, kc);
+    }
+
+    if (b->ukernel_nt) {
+      BEST_TIME( t, for (long r=0; r<tiles; r++) b->ukernel_nt( kc, At, Bt, 0.0, &C[r*mr*nr], 1, mr ) );
+      if ((it = suite_add( st, "flop/cycle", 2.0 * mr * nr * kc * tiles / (t * cycles), fpc ))) {
+        snprintf(it->name, sizeof(it->name), "kernel_nt/%s", b->kernel);
+        snprintf(it->size, sizeof(it->size), "%dx%dx%d", mr, nr, kc);
+      }
+    }
+
+    free(At);
+    free(Bt);
+    free(C);
+    fiveloops_ctx_free(ctx);
+  }
+
+  // SGEMM only has the host's kernel to offer, at twice the flops per cycle
+  const fiveloops_sblocking *sb = fiveloops_host_sblocking();
+  int mr = sb->mr, nr = sb->nr, kc = sb->kc;
+  float *At = aligned_alloc(64, sizeof(float) * mr * kc), *Bt = aligned_alloc(64, sizeof(float) * nr * kc);
+  float *C = aligned_alloc(64, sizeof(float) * mr * nr);
+  for (int i=0; i<mr*kc; i++) At[i] = (float) rand() / RAND_MAX - 0.5f;
+  for (int i=0; i<nr*kc; i++) Bt[i] = (float) rand() / RAND_MAX - 0.5f;
+  for (int i=0; i<mr*nr; i++) C[i] = 0.0f;
+
+  double t, fpc = flops_per_cycle > 0.0 ? flops_per_cycle : strstr(sb->kernel, "avx512") ? 32.0 : 16.0;
+  struct item *it;
+  BEST_TIME( t, for (int r=0; r<KERNEL_REPS; r++) sb->ukernel( kc, At, Bt, 1.0f, C, 1, mr ) );
+  if ((it = suite_add( st, "flop/cycle", 2.0 * mr * nr * kc * KERNEL_REPS / (t * st->ghz * 1e9), 2 * fpc ))) {
+    snprintf(it->name, sizeof(it->name), "kernel/%s", sb->kernel);
+    snprintf(it->size, sizeof(it->size), "%dx%dx%d", mr, nr, kc);
+  }
+  free(At);
+  free(Bt);
+  free(C);
+}
+
+// What the packers are measured against: the same number of bytes read from one buffer and written to another
+static double copy_rate( struct suite *st, long n, const double *X, double *P, int sliver )
+
+{
+  double t;
+  int reps = sliver ? KERNEL_REPS : 1;
+  BEST_TIME( t, for (int r=0; r<reps; r++) memcpy(P, X, sizeof(double) * n) );
+  return 2.0 * sizeof(double) * n * reps / (t * st->ghz * 1e9);
+}
+
+static void suite_packers( struct suite *st )
+
+{
+  const fiveloops_blocking *b = fiveloops_host_blocking();
+  int mr = b->mr, nr = b->nr, mc = b->mc, kc = b->kc, nc = b->nc;
+
+  // The source is a little bigger than the block in both directions, with a leading dimension that isn't
+  // a round number, the way a block of a bigger matrix would be; strided takes every other element
+  int pad = 3;
+  long biggest = 2L * (nc + pad) * (kc + pad);
+  double *X = random_buffer(biggest), *P = random_buffer((long) (nc + nr) * kc);
+
+  const char *layouts[] = { "col", "row", "strided" };
+
+  for (int which=0; which<4; which++) {
+    int is_A = which < 2, sliver = which % 2 == 0;
+    int rows = is_A ? (sliver ? mr : mc) : kc, cols = is_A ? kc : (sliver ? nr : nc);
+    const char *name = (const char *[]) { "packA_MRxKC", "packA_MCxKC", "packB_KCxNR", "packB_KCxNC" }[which];
+    long n = (long) rows * cols;
+    double roof = copy_rate( st, n, X, P, sliver );
+
+    for (int l=0; l<3; l++) {
+      int rs = l == 0 ? 1 : l == 1 ? cols + pad : 2;
+      int cs = l == 0 ? rows + pad : l == 1 ? 1 : 2 * (rows + pad);
+      int reps = sliver ? KERNEL_REPS : 1;
+      double t;
+
+      if (is_A && sliver)
+        BEST_TIME( t, for (int r=0; r<reps; r++) packA_MRxKC( mr, rows, kc, 1.0, X, rs, cs, P ) );
+      else if (is_A)
+        BEST_TIME( t, packA_MCxKC( mr, rows, kc, 1.0, X, rs, cs, P ) );
+      else if (sliver)
+        BEST_TIME( t, for (int r=0; r<reps; r++) packB_KCxNR( nr, kc, cols, X, rs, cs, P ) );
+      else
+        BEST_TIME( t, packB_KCxNC( nr, kc, cols, X, rs, cs, P ) );
+
+      struct item *it = suite_add( st, "byte/cycle", 2.0 * sizeof(double) * n * reps / (t * st->ghz * 1e9), roof );
+      if (it) {
+        snprintf(it->name, sizeof(it->name), "%s/%s", name, layouts[l]);
+        snprintf(it->size, sizeof(it->size), "%dx%d", rows, cols);
+      }
+    }
+  }
+
+  free(X);
+  free(P);
+}
+
+// The baseline is one "name percentage" line per item, after '#' comment lines. Returns -1 if it can't be read
+static int load_baseline( struct suite *st, const char *path, char *cpu, size_t len )
+
+{
+  FILE *f = fopen(path, "r");
+  if (!f)
+    return -1;
+
+  char line[256], name[64];
+  double pct;
+  snprintf(cpu, len, "unknown");
+  while (fgets(line, sizeof(line), f)) {
+    if (!strncmp(line, "# cpu: ", 7)) {
+      line[strcspn(line, "\n")] = 0;
+      snprintf(cpu, len, "%s", line + 7);
+    }
+    if (line[0] == '#' || sscanf(line, "%63s %lf", name, &pct) != 2)
+      continue;
+    for (int i=0; i<st->count; i++)
+      if (!strcmp(st->items[i].name, name))
+        st->items[i].base_pct = pct;
+  }
+  fclose(f);
+  return 0;
+}
+
+static int save_baseline( const struct suite *st, const char *path, const char *cpu )
+
+{
+  FILE *f = fopen(path, "w");
+  if (!f)
+    return -1;
+  fprintf(f, "# fiveloops_bench --suite baseline: percentage of the roof per item\n# cpu: %s\n", cpu);
+  for (int i=0; i<st->count; i++)
+    fprintf(f, "%s %.2f\n", st->items[i].name, st->items[i].pct);
+  return fclose(f);
+}
+
+static int run_suite( const char *which, const char *baseline, const char *save, double threshold,
+       double ghz, double flops_per_cycle, const char *format )
+
+{
+  static struct suite st;
+  int all = !strcmp(which, "all");
+  if (!all && strcmp(which, "kernels") && strcmp(which, "packers")) {
+    fprintf(stderr, "--suite must be kernels, packers or all\n");
+    return 1;
+  }
+
+  char cpu[128], base_cpu[256];
+  cpu_model(cpu, sizeof(cpu));
+  st.ghz = ghz > 0.0 ? ghz : measure_ghz();
+  if (all || !strcmp(which, "kernels"))
+    suite_kernels( &st, flops_per_cycle );
+  if (all || !strcmp(which, "packers"))
+    suite_packers( &st );
+
+  if (baseline) {
+    if (load_baseline( &st, baseline, base_cpu, sizeof(base_cpu) )) {
+      fprintf(stderr, "can't read the baseline %s\n", baseline);
+      return 1;
+    }
+    if (strcmp(cpu, base_cpu))
+      fprintf(stderr, "warning: the baseline is from a %s, not this %s\n", base_cpu, cpu);
+  }
+
+  int csv = !strcmp(format, "csv"), json = !strcmp(format, "json"), regressed = 0;
+  if (csv)
+    printf("cpu,item,size,rate,unit,roof,pct_roof,baseline_pct,regressed\n");
+  if (json)
+    printf("{\n  \"cpu\": \"%s\",\n  \"ghz\": %.3f,\n  \"threshold\": %.1f,\n  \"results\": [\n", cpu, st.ghz, threshold);
+  if (!csv && !json)
+    printf("%s, %.2f GHz, regression suite\n\n%-30s %-10s %8s %-10s %7s %7s %9s\n", cpu, st.ghz,
+           "item", "size", "rate", "unit", "roof", "%roof", "baseline");
+
+  for (int i=0; i<st.count; i++) {
+    const struct item *it = &st.items[i];
+    int bad = it->base_pct >= 0 && it->pct < it->base_pct * (1.0 - threshold / 100.0);
+    regressed |= bad;
+
+    if (csv)
+      printf("\"%s\",%s,%s,%.3f,%s,%.3f,%.2f,%.2f,%d\n", cpu, it->name, it->size, it->rate, it->unit, it->roof,
+             it->pct, it->base_pct, bad);
+    else if (json)
+      printf("%s    { \"item\": \"%s\", \"size\": \"%s\", \"rate\": %.3f, \"unit\": \"%s\", \"roof\": %.3f, "
+             "\"pct_roof\": %.2f, \"baseline_pct\": %.2f, \"regressed\": %s }", i ? ",\n" : "",
+             it->name, it->size, it->rate, it->unit, it->roof, it->pct, it->base_pct, bad ? "true" : "false");
+    else if (it->base_pct < 0)
+      printf("%-30s %-10s %8.2f %-10s %7.2f %6.1f%% %9s\n", it->name, it->size, it->rate, it->unit, it->roof,
+             it->pct, "-");
+    else
+      printf("%-30s %-10s %8.2f %-10s %7.2f %6.1f%% %8.1f%%%s\n", it->name, it->size, it->rate, it->unit, it->roof,
+             it->pct, it->base_pct, bad ? "  REGRESSED" : "");
+  }
+  if (json)
+    printf("\n  ]\n}\n");
+
+  if (save && save_baseline( &st, save, cpu )) {
+    fprintf(stderr, "can't write the baseline %s\n", save);
+    return 1;
+  }
+  if (regressed)
+    fprintf(stderr, "regressed by more than %.1f%% against %s\n", threshold, baseline);
+  return regressed;
+}
+
+int main( int argc, char **argv )
+
+{
+  const char *sweep = "all", *kernel = NULL, *format = "table";
+  const char *suite = NULL, *baseline = NULL, *save = NULL;
+  int max = 2048, step = 256, nthreads = 1;
+  double ghz = 0.0, flops_per_cycle = 0.0, threshold = 10.0;
+
+  for (int i=1; i<argc; i++) {
+    const char *arg = argv[i], *val = i + 1 < argc ? argv[i+1] : NULL;
+    if (!val) {
+      fprintf(stderr, "%s needs a value\n", arg);
+      return 1;
+    }
+    i++;
+    if      (!strcmp(arg, "--sweep"))           sweep = val;
+    else if (!strcmp(arg, "--max"))             max = atoi(val);
+    else if (!strcmp(arg, "--step"))            step = atoi(val);
+    else if (!strcmp(arg, "--threads"))         nthreads = atoi(val);
+    else if (!strcmp(arg, "--kernel"))          kernel = val;
+    else if (!strcmp(arg, "--ghz"))             ghz = atof(val);
+    else if (!strcmp(arg, "--flops-per-cycle")) flops_per_cycle = atof(val);
+    else if (!strcmp(arg, "--format"))          format = val;
+    else if (!strcmp(arg, "--suite"))           suite = val;
+    else if (!strcmp(arg, "--baseline"))        baseline = val;
+    else if (!strcmp(arg, "--save-baseline"))   save = val;
+    else if (!strcmp(arg, "--threshold"))       threshold = atof(val);
+    else {
+      fprintf(stderr, "unknown option %s (see the comment at the top of fiveloops_bench.c)\n", arg);
+      return 1;
+    }
+  }
+  if (suite)
+    return run_suite( suite, baseline, save, threshold, ghz, flops_per_cycle, format );
+  if (step <= 0 || max < step) {
+    fprintf(stderr, "--step must be positive and no bigger than --max\n");
+    return 1;
+  }
+
+  struct shape shapes[MAX_SHAPES];
+  int nshapes = make_shapes(sweep, max, step, shapes);
+  if (nshapes < 0) {
+    fprintf(stderr, "--sweep %s with --max %d and --step %d has more than %d shapes; raise --step\n",
+            sweep, max, step, MAX_SHAPES);
+    return 1;
+  }
+
+  // Either all the kernels the host can run, or just the one asked for (or the host's choice)
+  const char *kernels[32];
+  int nkernels = 1;
+  if (kernel && !strcmp(kernel, "all")) {
+    nkernels = fiveloops_kernels(kernels, 32);
+    nkernels = nkernels > 32 ? 32 : nkernels;
+  }
+  else
+    kernels[0] = kernel;
+
+  char cpu[128];
+  cpu_model(cpu, sizeof(cpu));
+  if (ghz <= 0.0)
+    ghz = measure_ghz();
+
+  int csv = !strcmp(format, "csv"), json = !strcmp(format, "json");
+  if (csv)
+    printf("cpu,kernel,threads,sweep,m,n,k,transA,transB,pad,seconds,gflops,pct_peak,ref_gflops,pct_ref,max_err\n");
+  if (json)
+    printf("{\n  \"cpu\": \"%s\",\n  \"ghz\": %.3f,\n  \"threads\": %d,\n  \"results\": [\n", cpu, ghz, nthreads);
+  if (!csv && !json)
+    printf("%s, %.2f GHz, %d thread(s)\n", cpu, ghz, nthreads);
+
+  int first = 1;
+  for (int kn=0; kn<nkernels; kn++) {
+    fiveloops_ctx *ctx = fiveloops_ctx_create_kernel(nthreads, kernels[kn]);
+    if (!ctx) {
+      fprintf(stderr, "can't run kernel %s on this host\n", kernels[kn]);
+      return 1;
+    }
+    const fiveloops_blocking *b = fiveloops_ctx_blocking(ctx);
+    if (!k0_ok(ctx)) {
+      fprintf(stderr, "kernel %s: k == 0 doesn't leave C := beta C\n", b->kernel);
+      return 1;
+    }
+
+    double fpc = flops_per_cycle > 0.0 ? flops_per_cycle : strstr(b->kernel, "avx512") ? 32.0 : 16.0;
+    double peak = ghz * fpc * nthreads;
+
+    if (!csv && !json) {
+      printf("\nkernel %s (MR %d, NR %d, MC %d, KC %d, NC %d), peak %.1f GFLOPs\n",
+             b->kernel, b->mr, b->nr, b->mc, b->kc, b->nc, peak);
+      printf("%-7s %6s %6s %6s %3s %4s %9s %7s %9s %7s %10s\n",
+             "sweep", "m", "n", "k", "op", "pad", "GFLOPs", "%peak", "ref", "%ref", "max err");
+    }
+
+    for (int i=0; i<nshapes; i++) {
+      const struct shape *s = &shapes[i];
+      struct result r = run_shape(ctx, s, peak);
+
+      if (csv)
+        printf("\"%s\",%s,%d,%s,%d,%d,%d,%c,%c,%d,%.6f,%.3f,%.2f,%.3f,%.2f,%.3g\n",
+               cpu, b->kernel, nthreads, s->sweep, s->m, s->n, s->k, s->transA, s->transB, s->pad,
+               r.seconds, r.gflops, r.pct_peak, r.ref_gflops, r.pct_ref, r.max_err);
+      else if (json)
+        printf("%s    { \"kernel\": \"%s\", \"sweep\": \"%s\", \"m\": %d, \"n\": %d, \"k\": %d, "
+               "\"transA\": \"%c\", \"transB\": \"%c\", \"pad\": %d, \"seconds\": %.6f, \"gflops\": %.3f, "
+               "\"pct_peak\": %.2f, \"ref_gflops\": %.3f, \"pct_ref\": %.2f, \"max_err\": %.3g }",
+               first ? "" : ",\n", b->kernel, s->sweep, s->m, s->n, s->k, s->transA, s->transB, s->pad,
+               r.seconds, r.gflops, r.pct_peak, r.ref_gflops, r.pct_ref, r.max_err);
+      else if (r.ref_gflops < 0)
+        printf("%-7s %6d %6d %6d  %c%c %4d %9.2f %6.1f%% %9s %7s %10s\n", s->sweep, s->m, s->n, s->k,
+               s->transA, s->transB, s->pad, r.gflops, r.pct_peak, "-", "-", "-");
+      else
+        printf("%-7s %6d %6d %6d  %c%c %4d %9.2f %6.1f%% %9.2f %6.1f%% %10.2e\n", s->sweep, s->m, s->n, s->k,
+               s->transA, s->transB, s->pad, r.gflops, r.pct_peak, r.ref_gflops, r.pct_ref, r.max_err);
+      fflush(stdout);
+      first = 0;
+    }
+    fiveloops_ctx_free(ctx);
+  }
+
+  if (json)
+    printf("\n  ]\n}\n");
+  return 0;
+}